@@ -0,0 +1,44 @@
+#pragma once
+
+#include "defs.h"
+#include "vec3f.h"
+
+typedef struct aabb aabb;
+
+struct aabb
+{
+    p3f lo;
+    p3f hi;
+};
+
+extern const aabb aabb_empty;
+
+inline aabb aabb_union(aabb a, aabb b)
+{
+    return (aabb) {
+        .lo = { .x = fminf(a.lo.x, b.lo.x), .y = fminf(a.lo.y, b.lo.y), .z = fminf(a.lo.z, b.lo.z) },
+        .hi = { .x = fmaxf(a.hi.x, b.hi.x), .y = fmaxf(a.hi.y, b.hi.y), .z = fmaxf(a.hi.z, b.hi.z) }
+    };
+}
+
+inline aabb aabb_expand(aabb a, p3f p)
+{
+    return aabb_union(a, (aabb) { .lo = p, .hi = p });
+}
+
+inline p3f aabb_centroid(aabb a)
+{
+    return (p3f) {
+        .x = 0.5f * (a.lo.x + a.hi.x),
+        .y = 0.5f * (a.lo.y + a.hi.y),
+        .z = 0.5f * (a.lo.z + a.hi.z)
+    };
+}
+
+inline f32 aabb_surface_area(aabb a)
+{
+    const f32 dx = a.hi.x - a.lo.x;
+    const f32 dy = a.hi.y - a.lo.y;
+    const f32 dz = a.hi.z - a.lo.z;
+    return (dx < 0.f) ? 0.f : 2.f * (dx * dy + dy * dz + dz * dx);
+}
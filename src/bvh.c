@@ -0,0 +1,332 @@
+#include "string.h"
+#include "malloc.h"
+#include "bvh.h"
+
+// Utils
+#define BVH_LEAF_SIZE 4
+#define BVH_MAX_LEAF_SIZE 16
+#define BVH_BINS 12
+#define BVH_MAX_DEPTH 64
+
+typedef struct bvh_builder
+{
+    hittable_array_list* list;
+    aabb* bounds;
+    p3f* centroids;
+    bvh_node* nodes;
+    int nodes_count;
+} bvh_builder;
+
+static void bvh_update_bounds(bvh_builder* b, bvh_node* node);
+static void bvh_subdivide(bvh_builder* b, int node_idx, int depth);
+static bool bvh_find_split(bvh_builder* b, bvh_node* node, int* axis, int* split_bin, f32* split_lo, f32* split_scale);
+static void bvh_swap(bvh_builder* b, int i, int j);
+static void bvh_sort_leaf_by_type(bvh_builder* b, bvh_node* node);
+static bool ray_hit_leaf(hittable_array_list* list, bvh_node* node, ray* r, interval t_interval, hit_record* rec);
+static int  bin_index(f32 v, f32 lo, f32 scale);
+
+
+void bvh_build(hittable_array_list* list)
+{
+    free(list->bvh_nodes);
+    list->bvh_nodes = NULL;
+    list->bvh_nodes_count = 0;
+    if (list->size == 0) return;
+
+    bvh_builder b = {
+        .list = list,
+        .bounds = malloc(list->size * sizeof(aabb)),
+        .centroids = malloc(list->size * sizeof(p3f)),
+        .nodes = malloc((2 * list->size - 1) * sizeof(bvh_node)),
+        .nodes_count = 1
+    };
+    if (!b.bounds || !b.centroids || !b.nodes) exit(1);
+
+    for (size_t i = 0; i < list->size; ++i)
+    {
+        b.bounds[i] = hittable_bounds(&list->data[i]);
+        b.centroids[i] = aabb_centroid(b.bounds[i]);
+    }
+
+    b.nodes[0] = (bvh_node){ .left_first = 0, .count = (int)list->size };
+    bvh_update_bounds(&b, &b.nodes[0]);
+    bvh_subdivide(&b, 0, 0);
+
+    free(b.bounds);
+    free(b.centroids);
+
+    list->bvh_nodes = b.nodes;
+    list->bvh_nodes_count = b.nodes_count;
+    list->bucketed = false;
+}
+
+bool bvh_raytest(hittable_array_list* list, ray* r, interval t_interval, hit_record* rec)
+{
+    const v3f inv_dir = { .x = 1.f / r->dir.x, .y = 1.f / r->dir.y, .z = 1.f / r->dir.z };
+    bvh_node* nodes = list->bvh_nodes;
+    bool hit_anything = false;
+
+    f32 t_enter;
+    if (!bvh_bounds_hit(&nodes[0].bounds, r, inv_dir, t_interval, &t_enter)) return false;
+
+    int stack[BVH_MAX_DEPTH * 2];
+    int top = 0;
+    stack[top++] = 0;
+
+    while (top > 0)
+    {
+        bvh_node* node = &nodes[stack[--top]];
+
+        if (node->count > 0)
+        {
+            if (ray_hit_leaf(list, node, r, t_interval, rec))
+            {
+                hit_anything = true;
+                t_interval.v_max = rec->t;
+            }
+            continue;
+        }
+
+        // push the far child first so the near one is visited first and shrinks t_max
+        f32 t_left, t_right;
+        const bool hit_left = bvh_bounds_hit(&nodes[node->left_first].bounds, r, inv_dir, t_interval, &t_left);
+        const bool hit_right = bvh_bounds_hit(&nodes[node->left_first + 1].bounds, r, inv_dir, t_interval, &t_right);
+
+        if (hit_left && hit_right)
+        {
+            const bool left_first = t_left <= t_right;
+            stack[top++] = left_first ? node->left_first + 1 : node->left_first;
+            stack[top++] = left_first ? node->left_first : node->left_first + 1;
+        }
+        else if (hit_left)
+        {
+            stack[top++] = node->left_first;
+        }
+        else if (hit_right)
+        {
+            stack[top++] = node->left_first + 1;
+        }
+    }
+
+    return hit_anything;
+}
+
+void bvh_update_bounds(bvh_builder* b, bvh_node* node)
+{
+    node->bounds = aabb_empty;
+    for (int i = node->left_first; i < node->left_first + node->count; ++i)
+    {
+        node->bounds = aabb_union(node->bounds, b->bounds[i]);
+    }
+}
+
+void bvh_subdivide(bvh_builder* b, int node_idx, int depth)
+{
+    bvh_node* node = &b->nodes[node_idx];
+    if (node->count <= BVH_LEAF_SIZE || depth + 1 >= BVH_MAX_DEPTH)
+    {
+        bvh_sort_leaf_by_type(b, node);
+        return;
+    }
+
+    int axis, split_bin;
+    f32 split_lo, split_scale;
+    int mid;
+    if (bvh_find_split(b, node, &axis, &split_bin, &split_lo, &split_scale))
+    {
+        int i = node->left_first;
+        int j = node->left_first + node->count - 1;
+        while (i <= j)
+        {
+            if (bin_index(b->centroids[i].e[axis], split_lo, split_scale) <= split_bin) ++i;
+            else bvh_swap(b, i, j--);
+        }
+        mid = i;
+    }
+    else if (node->count > BVH_MAX_LEAF_SIZE)
+    {
+        // not worth splitting by cost but too big for a leaf, cut it in half
+        mid = node->left_first + node->count / 2;
+    }
+    else
+    {
+        bvh_sort_leaf_by_type(b, node);
+        return;
+    }
+
+    const int left_count = mid - node->left_first;
+    if (left_count == 0 || left_count == node->count)
+    {
+        bvh_sort_leaf_by_type(b, node);
+        return;
+    }
+
+    const int left_idx = b->nodes_count;
+    b->nodes_count += 2;
+    b->nodes[left_idx] = (bvh_node){ .left_first = node->left_first, .count = left_count };
+    b->nodes[left_idx + 1] = (bvh_node){ .left_first = mid, .count = node->count - left_count };
+    node->left_first = left_idx;
+    node->count = 0;
+
+    bvh_update_bounds(b, &b->nodes[left_idx]);
+    bvh_update_bounds(b, &b->nodes[left_idx + 1]);
+    bvh_subdivide(b, left_idx, depth + 1);
+    bvh_subdivide(b, left_idx + 1, depth + 1);
+}
+
+bool bvh_find_split(bvh_builder* b, bvh_node* node, int* axis, int* split_bin, f32* split_lo, f32* split_scale)
+{
+    aabb centroid_bounds = aabb_empty;
+    for (int i = node->left_first; i < node->left_first + node->count; ++i)
+    {
+        centroid_bounds = aabb_expand(centroid_bounds, b->centroids[i]);
+    }
+
+    // binned surface area heuristic, a split must beat intersecting everything
+    f32 best_cost = node->count * aabb_surface_area(node->bounds);
+    bool found = false;
+
+    for (int a = 0; a < 3; ++a)
+    {
+        const f32 lo = centroid_bounds.lo.e[a];
+        const f32 extent = centroid_bounds.hi.e[a] - lo;
+        if (extent <= 0.f) continue;
+        const f32 scale = BVH_BINS / extent;
+
+        aabb bins[BVH_BINS];
+        int counts[BVH_BINS] = { 0 };
+        for (int k = 0; k < BVH_BINS; ++k) bins[k] = aabb_empty;
+
+        for (int i = node->left_first; i < node->left_first + node->count; ++i)
+        {
+            const int k = bin_index(b->centroids[i].e[a], lo, scale);
+            ++counts[k];
+            bins[k] = aabb_union(bins[k], b->bounds[i]);
+        }
+
+        f32 left_area[BVH_BINS - 1];
+        int left_count[BVH_BINS - 1];
+        aabb acc = aabb_empty;
+        int acc_count = 0;
+        for (int k = 0; k < BVH_BINS - 1; ++k)
+        {
+            acc = aabb_union(acc, bins[k]);
+            acc_count += counts[k];
+            left_area[k] = aabb_surface_area(acc);
+            left_count[k] = acc_count;
+        }
+
+        acc = aabb_empty;
+        acc_count = 0;
+        for (int k = BVH_BINS - 1; k > 0; --k)
+        {
+            acc = aabb_union(acc, bins[k]);
+            acc_count += counts[k];
+            const f32 cost = left_count[k - 1] * left_area[k - 1] + acc_count * aabb_surface_area(acc);
+            if (left_count[k - 1] > 0 && acc_count > 0 && cost < best_cost)
+            {
+                best_cost = cost;
+                *axis = a;
+                *split_bin = k - 1;
+                *split_lo = lo;
+                *split_scale = scale;
+                found = true;
+            }
+        }
+    }
+
+    return found;
+}
+
+void bvh_swap(bvh_builder* b, int i, int j)
+{
+    const hittable obj = b->list->data[i];
+    b->list->data[i] = b->list->data[j];
+    b->list->data[j] = obj;
+
+    const aabb bounds = b->bounds[i];
+    b->bounds[i] = b->bounds[j];
+    b->bounds[j] = bounds;
+
+    const p3f centroid = b->centroids[i];
+    b->centroids[i] = b->centroids[j];
+    b->centroids[j] = centroid;
+}
+
+void bvh_sort_leaf_by_type(bvh_builder* b, bvh_node* node)
+{
+    // leaves are small, insertion sort keeps runs of one type for the kernels
+    for (int i = node->left_first + 1; i < node->left_first + node->count; ++i)
+    {
+        for (int j = i; j > node->left_first && b->list->data[j - 1].type > b->list->data[j].type; --j)
+        {
+            bvh_swap(b, j - 1, j);
+        }
+    }
+}
+
+bool bvh_bounds_hit(aabb* bounds, ray* r, v3f inv_dir, interval t_interval, f32* t_enter)
+{
+    for (int a = 0; a < 3; ++a)
+    {
+        f32 t0 = (bounds->lo.e[a] - r->origin.e[a]) * inv_dir.e[a];
+        f32 t1 = (bounds->hi.e[a] - r->origin.e[a]) * inv_dir.e[a];
+        if (inv_dir.e[a] < 0.f)
+        {
+            const f32 t = t0;
+            t0 = t1;
+            t1 = t;
+        }
+        // conservative exit, rounding must not reject rays grazing the box
+        t1 *= 1.f + 2.f * error_gamma(3);
+        t_interval.v_min = t0 > t_interval.v_min ? t0 : t_interval.v_min;
+        t_interval.v_max = t1 < t_interval.v_max ? t1 : t_interval.v_max;
+        if (t_interval.v_max < t_interval.v_min) return false;
+    }
+
+    *t_enter = t_interval.v_min;
+    return true;
+}
+
+bool ray_hit_leaf(hittable_array_list* list, bvh_node* node, ray* r, interval t_interval, hit_record* rec)
+{
+    hittable* objs = &list->data[node->left_first];
+    bool hit_anything = false;
+
+    for (int i = 0; i < node->count;)
+    {
+        const EHittableType type = objs[i].type;
+        int end = i + 1;
+        while (end < node->count && objs[end].type == type) ++end;
+
+        bool hit = false;
+        switch (type)
+        {
+#define X_LEAF_RUN(NAME, type, member) \
+        case EHittableType_##NAME: hit = ray_hit_all_##type(r, t_interval, &objs[i], end - i, rec); break;
+        HITTABLE_TYPES(X_LEAF_RUN)
+#undef X_LEAF_RUN
+        default: break;
+        }
+
+        if (hit)
+        {
+            hit_anything = true;
+            t_interval.v_max = rec->t;
+        }
+        i = end;
+    }
+
+    return hit_anything;
+}
+
+int bin_index(f32 v, f32 lo, f32 scale)
+{
+    const int k = (int)((v - lo) * scale);
+    return k < BVH_BINS - 1 ? k : BVH_BINS - 1;
+}
+
+#undef BVH_LEAF_SIZE
+#undef BVH_MAX_LEAF_SIZE
+#undef BVH_BINS
+#undef BVH_MAX_DEPTH
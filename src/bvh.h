@@ -0,0 +1,24 @@
+#pragma once
+
+#include "defs.h"
+#include "aabb.h"
+#include "hittable.h"
+#include "ray.h"
+
+typedef struct bvh_node bvh_node;
+
+// Interior nodes have count 0 and their children at left_first and left_first + 1,
+// leaves reference count objects of the list starting at left_first.
+struct bvh_node
+{
+    aabb bounds;
+    int left_first;
+    int count;
+};
+
+// Reorders the list data so every leaf is a contiguous range sorted by type.
+void bvh_build(hittable_array_list* list);
+bool bvh_raytest(hittable_array_list* list, ray* r, interval t_interval, hit_record* rec);
+
+// Slab test of one node, t_enter is where the ray enters bounds within t_interval
+bool bvh_bounds_hit(aabb* bounds, ray* r, v3f inv_dir, interval t_interval, f32* t_enter);
@@ -1,10 +1,17 @@
 #include "stdio.h"
 #include "stdlib.h"
+#include "string.h"
 #include "malloc.h"
 #include "math.h"
 #include "camera.h"
 #include "hittable.h"
 #include "ray.h"
+#include "raybatch.h"
+#include "telemetry.h"
+#include "bvh.h"
+#include "topology.h"
+#include "irradiance.h"
+#include "rng.h"
 
 #define WIN32_LEAN_AND_MEAN
 #include "windows.h"
@@ -13,32 +20,117 @@
 
 
 // Utils
-#define MAX_THREADS_COUNT 32
+#define TILE_SIZE 32
+#define RAY_BATCH_CAPACITY 16384
+#define REPORT_INTERVAL_MS 500
+#define IRRADIANCE_STRIDE 4       // pixels between the pre-pass camera paths
+#define IRRADIANCE_SPACING_PX 16  // record spacing, in pixels at the focus distance
+#define IRRADIANCE_MAX_BOUNCE 2
+#define IRRADIANCE_SAMPLES 64
+#define IRRADIANCE_PREPASS_SAMPLE 0xFFFFFFFFu // sample index of the pre-pass paths, never rendered
+
+// Tiles whose rows live in one node's band of the buffers, see topology_alloc_rows.
+// Every node range is taken from on its own cache line.
+typedef union render_node_tiles
+{
+    struct
+    {
+        volatile LONG next_tile;
+        LONG end_tile;
+    };
+    char padding[64];
+} render_node_tiles;
 
-typedef struct camera_render_lines_args
+typedef struct render_tiles_queue
+{
+    pixel_rect region;
+    int tiles_x;
+    int tiles_count;
+    int samples;
+    int nodes_count;
+    render_node_tiles nodes[TOPOLOGY_MAX_NODES];
+
+    // the last worker to finish signals done
+    volatile LONG running;
+    HANDLE done;
+} render_tiles_queue;
+
+typedef struct camera_render_tiles_args
 {
     camera* cam;
     hittable_array_list* world;
-    int start_line;
-    int end_line; // excluded
+    render_tiles_queue* queue;
+    telemetry_counters* counters;
+    int cpu; // -1 leaves the thread unpinned
+    int node;
+} camera_render_tiles_args;
 
-    // statistics
-    int current_line;
-} camera_render_lines_args;
+typedef struct irradiance_fill_args
+{
+    camera* cam;
+    hittable_array_list* world;
+    irradiance_cache* cache;
+    volatile LONG next_record;
+    volatile LONG running;
+    HANDLE done;
+} irradiance_fill_args;
 
-static bool raytest(hittable_array_list* list, ray* r, interval t_interval, hit_record* rec);
-static c3f  ray_color(ray* r, int depth, hittable_array_list* world);
-static c3f  clamp_color(c3f color);
-static ray  get_ray(camera* cam, int i, int j);
+static c3f  ray_color(camera* cam, ray* r, int depth, hittable_array_list* world, long long* rays_traced, int* aov);
 static p3f  pixel_sample_square(camera* cam);
-static c3f  linear_to_gamma(c3f color);
-static void camera_render_lines(void* args);
+static void camera_render_tiles(void* args);
+static pixel_rect tile_rect(render_tiles_queue* queue, int tile);
+static int  take_tile(render_tiles_queue* queue, int node);
+static void split_tiles(camera* cam, render_tiles_queue* queue);
+static void world_replicate(camera* cam, hittable_array_list* world, int node, hittable_array_list* replica);
+static void camera_free_replicas(camera* cam);
+static void camera_build_irradiance(camera* cam, hittable_array_list* world);
+static void irradiance_fill(void* args);
 static p3f  defocus_disk_sample(camera* cam);
 
 
 void camera_initialize(camera* cam)
 {
     cam->image_height = max((int)(cam->image_width / cam->aspect_ration), 1);
+    camera_update_view(cam);
+
+    if (cam->crop.width <= 0 || cam->crop.height <= 0)
+    {
+        cam->crop = (pixel_rect){ .x = 0, .y = 0, .width = cam->image_width, .height = cam->image_height };
+    }
+    else
+    {
+        const int x_end = min(cam->crop.x + cam->crop.width, cam->image_width);
+        const int y_end = min(cam->crop.y + cam->crop.height, cam->image_height);
+        cam->crop.x = max(cam->crop.x, 0);
+        cam->crop.y = max(cam->crop.y, 0);
+        cam->crop.width = max(x_end - cam->crop.x, 0);
+        cam->crop.height = max(y_end - cam->crop.y, 0);
+    }
+
+    topology_query(&cam->topology);
+
+    // pixels outside of the crop region are never written, keep them black,
+    // every node gets a band of rows and renders the tiles inside of it first
+    cam->framebuffer = topology_alloc_rows(&cam->topology, cam->image_height, cam->image_width * sizeof(c3f));
+    cam->accumbuffer = topology_alloc_rows(&cam->topology, cam->image_height, cam->image_width * sizeof(c3f));
+    cam->aov_accumbuffer = cam->aovs
+        ? topology_alloc_rows(&cam->topology, cam->image_height, CAMERA_AOV_COUNT * cam->image_width * sizeof(c3f))
+        : NULL;
+    cam->accum_samples = 0;
+    cam->rays_traced = 0;
+    cam->cancel = 0;
+    cam->irradiance = NULL;
+    cam->replicas = NULL;
+    cam->replicas_source = NULL;
+
+    if (cam->mt_render)
+    {
+        cam->th_count = cam->topology.cpus_count;
+    }
+}
+
+void camera_update_view(camera* cam)
+{
     cam->center = cam->lookfrom;
 
     const f32 theta = degrees_to_radians(cam->fov);
@@ -71,138 +163,230 @@ void camera_initialize(camera* cam)
             v3f_add(cam->pixel_delta_u, cam->pixel_delta_v),
             0.5f));
 
+    cam->pixel_spread = v3f_length(cam->pixel_delta_u) / cam->focus_dist;
+
     f32 defocus_radius = cam->focus_dist * tanf(degrees_to_radians(cam->defocus_angle / 2));
     cam->defocus_disk_u = v3f_mul(cam->u, defocus_radius);
     cam->defocus_disk_v = v3f_mul(cam->v, defocus_radius);
+}
 
-    cam->framebuffer = (c3f*)malloc(cam->image_width * cam->image_height * sizeof(c3f));
-    if (!cam->framebuffer) exit(1);
-
-    if (cam->mt_render)
+void camera_delete(camera* cam)
+{
+    topology_free(cam->framebuffer);
+    topology_free(cam->accumbuffer);
+    topology_free(cam->aov_accumbuffer);
+    if (cam->irradiance)
     {
-        SYSTEM_INFO info;
-        GetSystemInfo(&info);
-        cam->th_count = info.dwNumberOfProcessors < MAX_THREADS_COUNT
-            ? info.dwNumberOfProcessors
-            : MAX_THREADS_COUNT;
+        irradiance_cache_delete(cam->irradiance);
+        free(cam->irradiance);
+        cam->irradiance = NULL;
     }
+    camera_free_replicas(cam);
+    topology_delete(&cam->topology);
 }
 
-void camera_delete(camera* cam)
+void camera_render(camera* cam, hittable_array_list* world)
 {
-    free(cam->framebuffer);
+    camera_reset(cam);
+    camera_render_pass(cam, world, cam->samples_per_px);
 }
 
-void camera_render(camera* cam, hittable_array_list* world)
+void camera_prepare(camera* cam, hittable_array_list* world)
 {
+    // records are in world space, they stay valid when only the view changes
+    if (cam->irradiance_error > 0.f && !cam->irradiance) camera_build_irradiance(cam, world);
+
+    // the copies are kept for all later passes, preview mode runs many short ones
+    if (cam->mt_render && cam->topology.nodes_count > 1 && cam->replicas_source != world)
+    {
+        camera_free_replicas(cam);
+        cam->replicas = malloc(cam->topology.nodes_count * sizeof(hittable_array_list));
+        if (!cam->replicas) exit(1);
+        for (int n = 0; n < cam->topology.nodes_count; ++n)
+        {
+            world_replicate(cam, world, n, &cam->replicas[n]);
+        }
+        cam->replicas_source = world;
+    }
+}
+
+bool camera_render_pass(camera* cam, hittable_array_list* world, int samples)
+{
+    camera_prepare(cam, world);
+
+    render_tiles_queue queue = {
+        .region = cam->crop,
+        .tiles_x = (cam->crop.width + TILE_SIZE - 1) / TILE_SIZE,
+        .samples = samples
+    };
+    queue.tiles_count = queue.tiles_x * ((cam->crop.height + TILE_SIZE - 1) / TILE_SIZE);
+    split_tiles(cam, &queue);
+
+    telemetry tm;
+    const int workers_count = cam->mt_render ? cam->th_count : 1;
+    telemetry_begin(
+        &tm,
+        workers_count,
+        queue.tiles_count,
+        (long long)cam->crop.width * cam->crop.height * samples,
+        cam->stats_path,
+        cam->quiet_passes);
+
     if (cam->mt_render)
     {
-        int lines_count = cam->image_height / cam->th_count;
-        static camera_render_lines_args args[MAX_THREADS_COUNT];
-        static HANDLE th_handles[MAX_THREADS_COUNT];
+        camera_render_tiles_args* args = malloc(cam->th_count * sizeof(camera_render_tiles_args));
+        if (!args) exit(1);
+
+        queue.running = cam->th_count;
+        queue.done = CreateEventA(NULL, TRUE, FALSE, NULL);
+        if (!queue.done) exit(1);
+
         for (int t = 0; t < cam->th_count; ++t)
         {
-            args[t] = (camera_render_lines_args){
+            const int node = cam->topology.cpus[t % cam->topology.cpus_count].node;
+            args[t] = (camera_render_tiles_args){
                 .cam = cam,
-                .world = world,
-                .start_line = t * lines_count,
-                .end_line = (t + 1 == cam->th_count)
-                    ? cam->image_height
-                    : (t + 1) * lines_count,
-                .current_line = t * lines_count
+                .world = cam->replicas ? &cam->replicas[node] : world,
+                .queue = &queue,
+                .counters = &tm.workers[t],
+                .cpu = t,
+                .node = node
             };
 
-            th_handles[t] = (HANDLE)_beginthread(camera_render_lines, 0, &args[t]);
+            _beginthread(camera_render_tiles, 0, &args[t]);
         }
 
-        int running_th_count = cam->th_count;
-        while (running_th_count > 0)
+        while (WaitForSingleObject(queue.done, REPORT_INTERVAL_MS) == WAIT_TIMEOUT)
         {
-            int lines_scanned = 0;
-            for (int t = 0; t < cam->th_count; ++t)
-            {
-                lines_scanned += (args[t].current_line - args[t].start_line);
-                if (th_handles[t] != NULL && WaitForSingleObject(th_handles[t], 0) != WAIT_TIMEOUT)
-                {
-                    --running_th_count;
-                    th_handles[t] = 0;
-                }
-            }
-            fprintf_s(stderr, "\rScanline progress... %3d%%", (lines_scanned * 100) / cam->image_height);
-            Sleep(100);
+            telemetry_report(&tm);
         }
+        CloseHandle(queue.done);
+        free(args);
     }
     else
     {
-        camera_render_lines_args args = {
+        camera_render_tiles_args args = {
             .cam = cam,
             .world = world,
-            .start_line = 0,
-            .end_line = cam->image_height
+            .queue = &queue,
+            .counters = &tm.workers[0],
+            .cpu = -1,
+            .node = 0
         };
 
-        camera_render_lines(&args);
+        camera_render_tiles(&args);
     }
-    
-    fprintf_s(stderr, "\rScanline progress... DONE\n");
+
+    const bool cancelled = cam->cancel != 0;
+    cam->rays_traced += telemetry_rays(&tm);
+    telemetry_end(&tm, cancelled);
+    if (cancelled) return false;
+
+    cam->accum_samples += samples;
+    return true;
 }
 
-bool raytest(hittable_array_list* list, ray* r, interval t_interval, hit_record* rec)
+void camera_reset(camera* cam)
 {
-    hit_record tmp_rec;
-    bool hit_anything = false;
-    f32 closest_t = t_interval.v_max;
-
-    for (int i = 0; i < (int)list->size; ++i)
+    memset(cam->accumbuffer, 0, cam->image_width * cam->image_height * sizeof(c3f));
+    if (cam->aov_accumbuffer)
     {
-        hittable* obj = &list->data[i];
-        const interval new_interval = { .v_min = t_interval.v_min, .v_max = closest_t };
-        if (ray_hit(r, new_interval, obj, &tmp_rec))
-        {
-            hit_anything = true;
-            closest_t = tmp_rec.t;
-            *rec = tmp_rec;
-        }
+        memset(cam->aov_accumbuffer, 0, CAMERA_AOV_COUNT * cam->image_width * cam->image_height * sizeof(c3f));
     }
+    cam->accum_samples = 0;
+    cam->rays_traced = 0;
+    InterlockedExchange(&cam->cancel, 0);
+}
+
+void camera_cancel(camera* cam)
+{
+    InterlockedExchange(&cam->cancel, 1);
+}
 
-    return hit_anything;
+void camera_merge_crop(camera* cam, c3f* target)
+{
+    for (int row = cam->crop.y; row < cam->crop.y + cam->crop.height; ++row)
+    {
+        const int offset = row * cam->image_width + cam->crop.x;
+        memcpy(&target[offset], &cam->framebuffer[offset], cam->crop.width * sizeof(c3f));
+    }
 }
 
-c3f ray_color(ray* r, int depth, hittable_array_list* world)
+c3f ray_color(camera* cam, ray* r, int depth, hittable_array_list* world, long long* rays_traced, int* aov)
 {
     if (depth <= 0) return (c3f) { .r = 0, .g = 0, .b = 0 };
+    if (cam->deterministic) rng_begin_bounce(cam->max_depth - depth);
 
     hit_record rec;
-    const interval t_interval = { .v_min = 0.001f, .v_max = INFINITY };
+    const interval t_interval = interval_ray;
+    ++*rays_traced;
     if (raytest(world, r, t_interval, &rec))
     {
+        // only the primary hit picks the aov, bounces pass NULL
+        if (aov) *aov = rec.mat->type;
+
         ray scattered;
         c3f attenuation;
         if (material_scatter(rec.mat, r, &rec, &attenuation, &scattered))
         {
-            return v3f_mul_comp(attenuation, ray_color(&scattered, depth - 1, world));
+            // past the first bounce diffuse hits reuse the cached indirect light
+            c3f radiance;
+            if (cam->irradiance
+                && depth < cam->max_depth
+                && rec.mat->type == EMaterialType_LAMBERTIAN
+                && irradiance_cache_lookup(cam->irradiance, rec.p, rec.normal, &radiance))
+            {
+                return v3f_mul_comp(attenuation, radiance);
+            }
+
+            return v3f_mul_comp(attenuation, ray_color(cam, &scattered, depth - 1, world, rays_traced, NULL));
         }
         return (c3f) { .r = 0, .g = 0, .b = 0 };
     }
 
-    const v3f unit_direction = v3f_unit(r->dir);
-    const f32 a = 0.5f * (unit_direction.y + 1.f);
+    if (aov) *aov = CAMERA_AOV_BACKGROUND;
+    return ray_background(r);
+}
 
-    const c3f c1 = v3f_mul((c3f) { .r = 1.f, .g = 1.f, .b = 1.f }, 1.f - a);
-    const c3f c2 = v3f_mul((c3f) { .r = 0.5f, .g = 0.7f, .b = 1.f }, a);
-    return v3f_add(c1, c2);
+void camera_resolve(camera* cam)
+{
+    const int pixels_count = cam->image_width * cam->image_height;
+    const f32 total_samples = (f32)max(cam->accum_samples, 1);
+    for (int i = 0; i < pixels_count; ++i)
+    {
+        cam->framebuffer[i] = v3f_div(cam->accumbuffer[i], total_samples);
+    }
 }
 
-c3f clamp_color(c3f color)
+void camera_resolve_aov(camera* cam, int aov, c3f* target)
 {
-    return (c3f) {
-        .r = clamp(color.r, 0.f, 0.999f),
-        .g = clamp(color.g, 0.f, 0.999f),
-        .b = clamp(color.b, 0.f, 0.999f)
-    };
+    const int pixels_count = cam->image_width * cam->image_height;
+    const f32 total_samples = (f32)max(cam->accum_samples, 1);
+    for (int i = 0; i < pixels_count; ++i)
+    {
+        target[i] = v3f_div(cam->aov_accumbuffer[(size_t)i * CAMERA_AOV_COUNT + aov], total_samples);
+    }
 }
 
-ray get_ray(camera* cam, int col, int row)
+size_t camera_batch_bytes(camera* cam, hittable_array_list* world)
+{
+    if (!cam->ray_batching) return 0;
+    const int workers_count = cam->mt_render ? cam->th_count : 1;
+    return workers_count * ray_batch_bytes(RAY_BATCH_CAPACITY, world);
+}
+
+size_t camera_irradiance_bytes(camera* cam)
+{
+    if (cam->irradiance) return irradiance_cache_bytes(cam->irradiance->records_count);
+    if (cam->irradiance_error <= 0.f) return 0;
+
+    // every pre-pass path adds at most one record per bounce past the first
+    const int paths_count = ((cam->crop.width + IRRADIANCE_STRIDE - 1) / IRRADIANCE_STRIDE)
+        * ((cam->crop.height + IRRADIANCE_STRIDE - 1) / IRRADIANCE_STRIDE);
+    return irradiance_cache_bytes(paths_count * IRRADIANCE_MAX_BOUNCE);
+}
+
+ray camera_get_ray(camera* cam, int col, int row)
 {
     const v3f pixel_center = v3f_add(
         cam->pixel00_loc,
@@ -212,7 +396,16 @@ ray get_ray(camera* cam, int col, int row)
     const v3f pixel_sample = v3f_add(pixel_center, pixel_sample_square(cam));
     const p3f ray_origin = (cam->defocus_angle <= 0.f) ? cam->center : defocus_disk_sample(cam);
     const v3f ray_direction = v3f_sub(pixel_sample, ray_origin);
-    return (ray) { .origin = ray_origin, .dir = ray_direction };
+    const f32 ray_time = (cam->shutter_close > cam->shutter_open)
+        ? rand_range(cam->shutter_open, cam->shutter_close)
+        : cam->shutter_open;
+    return (ray) {
+        .origin = ray_origin,
+        .dir = ray_direction,
+        .time = ray_time,
+        .cone_width = 0.f,
+        .cone_spread = cam->pixel_spread
+    };
 }
 
 p3f pixel_sample_square(camera* cam)
@@ -225,35 +418,298 @@ p3f pixel_sample_square(camera* cam)
         v3f_mul(cam->pixel_delta_v, py));
 }
 
-c3f linear_to_gamma(c3f color)
+void camera_render_tiles(void* args)
+{
+    struct camera_render_tiles_args* rparams = args;
+    render_tiles_queue* queue = rparams->queue;
+    camera* cam = rparams->cam;
+    const f32 total_samples = (f32)(cam->accum_samples + queue->samples);
+
+    // pin before allocating so the batch buffers are first touched on the home node
+    if (rparams->cpu >= 0) topology_pin_thread(&cam->topology, rparams->cpu);
+
+    // deterministic renders key every path instead, see rng.h
+    if (!cam->deterministic) rng_seed_thread(telemetry_ticks() ^ ((unsigned long long)GetCurrentThreadId() << 32));
+
+    ray_batch batch;
+    if (cam->ray_batching) ray_batch_init(&batch, RAY_BATCH_CAPACITY);
+
+    c3f colors[TILE_SIZE * TILE_SIZE];
+    c3f aov_colors[TILE_SIZE * TILE_SIZE * CAMERA_AOV_COUNT]; // CAMERA_AOV_COUNT per pixel
+
+    for (int tile = take_tile(queue, rparams->node);
+        tile >= 0;
+        tile = take_tile(queue, rparams->node))
+    {
+        // cooperative cancellation, the tiles already taken are left as they are
+        if (cam->cancel) break;
+
+        const long long start = telemetry_ticks();
+        long long rays_traced = 0;
+        const pixel_rect rect = tile_rect(queue, tile);
+        memset(colors, 0, sizeof(colors));
+        if (cam->aovs) memset(aov_colors, 0, sizeof(aov_colors));
+
+        if (cam->ray_batching)
+        {
+            rays_traced = ray_batch_render_tile(
+                &batch, cam, rparams->world, rect, queue->samples, colors, cam->aovs ? aov_colors : NULL);
+        }
+        else
+        {
+            for (int row = 0; row < rect.height; ++row)
+            {
+                for (int col = 0; col < rect.width; ++col)
+                {
+                    const int pixel = row * rect.width + col;
+                    c3f color = { .r = 0, .g = 0, .b = 0 };
+                    for (int sample = 0; sample < queue->samples; ++sample)
+                    {
+                        if (cam->deterministic)
+                        {
+                            rng_begin_path(
+                                (unsigned long long)(rect.y + row) * cam->image_width + rect.x + col,
+                                cam->accum_samples + sample);
+                        }
+                        ray r = camera_get_ray(cam, rect.x + col, rect.y + row);
+                        int aov = CAMERA_AOV_BACKGROUND;
+                        const c3f radiance = ray_color(
+                            cam, &r, cam->max_depth, rparams->world, &rays_traced, cam->aovs ? &aov : NULL);
+                        color = v3f_add(color, radiance);
+                        if (cam->aovs)
+                        {
+                            c3f* target = &aov_colors[pixel * CAMERA_AOV_COUNT + aov];
+                            *target = v3f_add(*target, radiance);
+                        }
+                    }
+                    colors[pixel] = color;
+                }
+            }
+        }
+
+        for (int row = 0; row < rect.height; ++row)
+        {
+            for (int col = 0; col < rect.width; ++col)
+            {
+                const int idx = (rect.y + row) * cam->image_width + rect.x + col;
+                const int pixel = row * rect.width + col;
+                cam->accumbuffer[idx] = v3f_add(cam->accumbuffer[idx], colors[pixel]);
+                cam->framebuffer[idx] = v3f_div(cam->accumbuffer[idx], total_samples);
+
+                for (int aov = 0; cam->aovs && aov < CAMERA_AOV_COUNT; ++aov)
+                {
+                    c3f* sum = &cam->aov_accumbuffer[(size_t)idx * CAMERA_AOV_COUNT + aov];
+                    *sum = v3f_add(*sum, aov_colors[pixel * CAMERA_AOV_COUNT + aov]);
+                }
+            }
+        }
+
+        telemetry_add_tile(
+            rparams->counters,
+            (long long)rect.width * rect.height * queue->samples,
+            rays_traced,
+            telemetry_ticks() - start);
+    }
+
+    if (cam->ray_batching) ray_batch_delete(&batch);
+
+    if (queue->done && InterlockedDecrement(&queue->running) == 0) SetEvent(queue->done);
+}
+
+pixel_rect tile_rect(render_tiles_queue* queue, int tile)
+{
+    const int x = queue->region.x + (tile % queue->tiles_x) * TILE_SIZE;
+    const int y = queue->region.y + (tile / queue->tiles_x) * TILE_SIZE;
+    return (pixel_rect) {
+        .x = x,
+        .y = y,
+        .width = min(TILE_SIZE, queue->region.x + queue->region.width - x),
+        .height = min(TILE_SIZE, queue->region.y + queue->region.height - y)
+    };
+}
+
+int take_tile(render_tiles_queue* queue, int node)
+{
+    // the home node first, then help the others once it ran dry
+    for (int i = 0; i < queue->nodes_count; ++i)
+    {
+        render_node_tiles* tiles = &queue->nodes[(node + i) % queue->nodes_count];
+        if (tiles->next_tile >= tiles->end_tile) continue;
+
+        const int tile = InterlockedIncrement(&tiles->next_tile) - 1;
+        if (tile < tiles->end_tile) return tile;
+    }
+    return -1;
+}
+
+void split_tiles(camera* cam, render_tiles_queue* queue)
+{
+    // tile rows are ordered top to bottom, so every node owns one range of tiles
+    const int tiles_y = queue->tiles_x > 0 ? queue->tiles_count / queue->tiles_x : 0;
+    queue->nodes_count = cam->topology.nodes_count;
+
+    int tile_row = 0;
+    for (int n = 0; n < queue->nodes_count; ++n)
+    {
+        queue->nodes[n].next_tile = tile_row * queue->tiles_x;
+        while (tile_row < tiles_y
+            && topology_row_node(&cam->topology, queue->region.y + tile_row * TILE_SIZE, cam->image_height) <= n)
+        {
+            ++tile_row;
+        }
+        queue->nodes[n].end_tile = tile_row * queue->tiles_x;
+    }
+}
+
+void world_replicate(camera* cam, hittable_array_list* world, int node, hittable_array_list* replica)
+{
+    // materials are stored inline in the objects, textures stay in the shared cache
+    *replica = *world;
+    replica->capacity = world->size;
+    replica->data = topology_alloc(&cam->topology, world->size * sizeof(hittable), node);
+    memcpy(replica->data, world->data, world->size * sizeof(hittable));
+
+    replica->bvh_nodes = NULL;
+    if (world->bvh_nodes_count > 0)
+    {
+        replica->bvh_nodes = topology_alloc(&cam->topology, world->bvh_nodes_count * sizeof(bvh_node), node);
+        memcpy(replica->bvh_nodes, world->bvh_nodes, world->bvh_nodes_count * sizeof(bvh_node));
+    }
+}
+
+void camera_free_replicas(camera* cam)
 {
-    return (c3f) {
-        .r = sqrtf(color.r),
-        .g = sqrtf(color.g),
-        .b = sqrtf(color.b)
+    for (int n = 0; cam->replicas && n < cam->topology.nodes_count; ++n)
+    {
+        topology_free(cam->replicas[n].data);
+        topology_free(cam->replicas[n].bvh_nodes);
+    }
+    free(cam->replicas);
+    cam->replicas = NULL;
+    cam->replicas_source = NULL;
+}
+
+void camera_build_irradiance(camera* cam, hittable_array_list* world)
+{
+    const f64 start = telemetry_now();
+    irradiance_cache* cache = malloc(sizeof(irradiance_cache));
+    if (!cache) exit(1);
+    irradiance_cache_init(cache, v3f_length(cam->pixel_delta_u) * IRRADIANCE_SPACING_PX, cam->irradiance_error);
+
+    // sparse camera paths place the records where the later diffuse hits will be
+    for (int row = cam->crop.y; row < cam->crop.y + cam->crop.height; row += IRRADIANCE_STRIDE)
+    {
+        for (int col = cam->crop.x; col < cam->crop.x + cam->crop.width; col += IRRADIANCE_STRIDE)
+        {
+            if (cam->deterministic)
+            {
+                rng_begin_path((unsigned long long)row * cam->image_width + col, IRRADIANCE_PREPASS_SAMPLE);
+            }
+            ray r = camera_get_ray(cam, col, row);
+            for (int bounce = 0; bounce <= IRRADIANCE_MAX_BOUNCE; ++bounce)
+            {
+                if (cam->deterministic) rng_begin_bounce(bounce);
+                hit_record rec;
+                if (!raytest(world, &r, interval_ray, &rec)) break;
+
+                if (bounce > 0 && rec.mat->type == EMaterialType_LAMBERTIAN)
+                {
+                    irradiance_cache_add(cache, ray_spawn_origin(&rec, rec.normal), rec.normal);
+                }
+
+                ray scattered;
+                c3f attenuation;
+                if (!material_scatter(rec.mat, &r, &rec, &attenuation, &scattered)) break;
+                r = scattered;
+            }
+        }
+    }
+
+    irradiance_fill_args fill = {
+        .cam = cam,
+        .world = world,
+        .cache = cache,
+        .next_record = 0
     };
+
+    if (cam->mt_render)
+    {
+        fill.running = cam->th_count;
+        fill.done = CreateEventA(NULL, TRUE, FALSE, NULL);
+        if (!fill.done) exit(1);
+
+        for (int t = 0; t < cam->th_count; ++t) _beginthread(irradiance_fill, 0, &fill);
+
+        WaitForSingleObject(fill.done, INFINITE);
+        CloseHandle(fill.done);
+    }
+    else
+    {
+        irradiance_fill(&fill);
+    }
+
+    fprintf_s(stderr, "Irradiance cache... %d records | %.2fs\n", cache->records_count, telemetry_now() - start);
+    cam->irradiance = cache;
 }
 
-void camera_render_lines(void* args)
+void irradiance_fill(void* args)
 {
-    struct camera_render_lines_args* rparams = args;
-    for (int row = rparams->start_line; row < rparams->end_line; ++row)
+    irradiance_fill_args* fill = args;
+    camera* cam = fill->cam;
+    long long rays_traced = 0;
+    if (!cam->deterministic) rng_seed_thread(telemetry_ticks() ^ ((unsigned long long)GetCurrentThreadId() << 32));
+
+    // record paths are numbered after the pixel paths
+    const unsigned long long first_path = (unsigned long long)cam->image_width * cam->image_height;
+
+    for (int i = InterlockedIncrement(&fill->next_record) - 1;
+        i < fill->cache->records_count;
+        i = InterlockedIncrement(&fill->next_record) - 1)
     {
-        rparams->current_line = row;
-        //fprintf_s(stderr, "\rScanline progress... %3d%%", (row * 100) / rparams->cam->image_height);
-        for (int col = 0; col < rparams->cam->image_width; ++col)
+        irradiance_record* record = &fill->cache->records[i];
+        c3f sum = { .r = 0.f, .g = 0.f, .b = 0.f };
+        f32 inverse_distances = 0.f;
+
+        // cosine weighted like the lambertian scatter, the mean is the reflected light per albedo
+        for (int sample = 0; sample < IRRADIANCE_SAMPLES; ++sample)
         {
-            c3f color = { .r = 0, .g = 0, .b = 0 };
-            for (int sample = 0; sample < rparams->cam->samples_per_px; ++sample)
+            if (cam->deterministic) rng_begin_path(first_path + i, sample);
+            v3f dir = v3f_add(record->normal, v3f_random_unit_vector());
+            if (v3f_near_zero(dir)) dir = record->normal;
+            ray r = {
+                .origin = record->p,
+                .dir = dir,
+                .time = cam->shutter_open,
+                .cone_width = 0.f,
+                .cone_spread = 1.f
+            };
+
+            hit_record rec;
+            if (!raytest(fill->world, &r, interval_ray, &rec))
+            {
+                sum = v3f_add(sum, ray_background(&r));
+                continue;
+            }
+
+            inverse_distances += 1.f / (rec.t * v3f_length(r.dir));
+
+            ray scattered;
+            c3f attenuation;
+            if (material_scatter(rec.mat, &r, &rec, &attenuation, &scattered))
             {
-                ray r = get_ray(rparams->cam, col, row);
-                color = v3f_add(color, ray_color(&r, rparams->cam->max_depth, rparams->world));
+                const c3f radiance = ray_color(cam, &scattered, cam->max_depth - 2, fill->world, &rays_traced, NULL);
+                sum = v3f_add(sum, v3f_mul_comp(attenuation, radiance));
             }
-            rparams->cam->framebuffer[row * rparams->cam->image_width + col]
-                = clamp_color(linear_to_gamma(v3f_div(color, (f32)rparams->cam->samples_per_px)));
         }
+
+        // harmonic mean distance, small near other geometry where the light changes fast
+        const f32 spacing = fill->cache->spacing;
+        const f32 radius = inverse_distances > 0.f ? IRRADIANCE_SAMPLES / inverse_distances : spacing;
+        record->radius = clamp(radius, 0.1f * spacing, spacing);
+        record->radiance = v3f_div(sum, (f32)IRRADIANCE_SAMPLES);
     }
-    //fprintf_s(stderr, "\rScanline progress... DONE\n");
+
+    if (fill->done && InterlockedDecrement(&fill->running) == 0) SetEvent(fill->done);
 }
 
 p3f defocus_disk_sample(camera* cam)
@@ -267,4 +723,11 @@ p3f defocus_disk_sample(camera* cam)
 }
 
 #undef WIN32_LEAN_AND_MEAN
-#undef MAX_THREADS_COUNT
+#undef TILE_SIZE
+#undef RAY_BATCH_CAPACITY
+#undef REPORT_INTERVAL_MS
+#undef IRRADIANCE_STRIDE
+#undef IRRADIANCE_SPACING_PX
+#undef IRRADIANCE_MAX_BOUNCE
+#undef IRRADIANCE_SAMPLES
+#undef IRRADIANCE_PREPASS_SAMPLE
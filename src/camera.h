@@ -2,9 +2,25 @@
 
 #include "defs.h"
 #include "vec3f.h"
+#include "topology.h"
+#include "material.h"
+#include "irradiance.h"
 
 
+// AOVs split the radiance by the material type of the first hit, the sky comes last
+#define CAMERA_AOV_COUNT (EMaterialType_COUNT + 1)
+#define CAMERA_AOV_BACKGROUND EMaterialType_COUNT
+
 typedef struct camera camera;
+typedef struct pixel_rect pixel_rect;
+
+struct pixel_rect
+{
+    int x;
+    int y;
+    int width;
+    int height;
+};
 
 struct camera
 {
@@ -20,20 +36,52 @@ struct camera
     v3f defocus_disk_u;
     v3f defocus_disk_v;
     f32 focus_dist;
+    f32 shutter_open;  // ray times are sampled in [shutter_open, shutter_close)
+    f32 shutter_close;
     int image_width;
     int image_height;
     v3f center;
     v3f pixel_delta_u;
     v3f pixel_delta_v;
     v3f pixel00_loc;
+    f32 pixel_spread; // angle covered by one pixel, starts the ray cones
     int samples_per_px;
     int max_depth;
     bool mt_render;
+    bool ray_batching; // trace tiles breadth-first with sorted secondary rays
+    bool aovs;         // keep per material radiance sums next to the beauty
+    bool deterministic; // random numbers keyed by pixel, sample and bounce, output independent of threads and tiles
+    f32 irradiance_error; // > 0 reuses cached indirect diffuse light within this error bound
     int th_count;
-    c3f* framebuffer;
+    cpu_topology topology; // workers are pinned to its cpus, buffers spread over its nodes
+    pixel_rect crop; // region to render, zero size means full frame
+    const char* stats_path; // optional JSON file with render telemetry
+    bool quiet_passes;      // no progress lines per pass, the preview reports its own
+    c3f* framebuffer; // linear HDR radiance, display transforms are in tonemap.h
+    c3f* accumbuffer; // linear radiance sums of all passes since the last reset
+    c3f* aov_accumbuffer; // CAMERA_AOV_COUNT sums per pixel, NULL without aovs
+    irradiance_cache* irradiance; // built before the first pass, read-only afterwards
+    struct hittable_array_list* replicas; // read-only scene copy per node, made before the first threaded pass
+    struct hittable_array_list* replicas_source; // world the replicas were copied from
+    int accum_samples;
+    long long rays_traced; // by the passes since the last reset
+    volatile long cancel;
 };
 
 void camera_initialize(camera* cam);
+void camera_update_view(camera* cam);
 void camera_delete(camera* cam);
 void camera_render(camera* cam, struct hittable_array_list* world);
+void camera_prepare(camera* cam, struct hittable_array_list* world); // one time work done before the first pass
+bool camera_render_pass(camera* cam, struct hittable_array_list* world, int samples);
+void camera_reset(camera* cam);
+void camera_cancel(camera* cam);
+struct ray camera_get_ray(camera* cam, int col, int row);
+void camera_merge_crop(camera* cam, c3f* target);
+void camera_resolve(camera* cam); // framebuffer from the accumulated sums, for sums loaded from elsewhere
+void camera_resolve_aov(camera* cam, int aov, c3f* target);
+
+// Upper bounds of what the passes allocate besides the camera buffers, for budget checks
+size_t camera_batch_bytes(camera* cam, struct hittable_array_list* world); // ray batches of all workers
+size_t camera_irradiance_bytes(camera* cam); // cache built by camera_prepare, 0 without one
 
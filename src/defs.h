@@ -3,10 +3,23 @@
 #include "stdlib.h"
 #include "stdbool.h"
 #include "math.h"
+#include "float.h"
 
 typedef float  f32;
 typedef double f64;
 
+// Precision of the intersection math. Building with RT_GEOMETRY_F64 only widens the
+// geometry kernels, storage, shading and the rest of the renderer stay f32.
+#ifdef RT_GEOMETRY_F64
+typedef f64 fgeo;
+#define fgeo_sqrt sqrt
+#define fgeo_copysign copysign
+#else
+typedef f32 fgeo;
+#define fgeo_sqrt sqrtf
+#define fgeo_copysign copysignf
+#endif
+
 #define PI 3.1415926535897932385
 
 inline f32 degrees_to_radians(f32 degrees)
@@ -14,17 +27,17 @@ inline f32 degrees_to_radians(f32 degrees)
     return (degrees * (float)PI) / 180.0f;
 }
 
-inline f32 rand01()
+inline f32 clamp(f32 v, f32 a, f32 b)
 {
-    return (f32)rand() / (RAND_MAX + 1.f);
+    return (v < a) ? a : ((v > b) ? b : v);
 }
 
-inline f32 rand_range(f32 v_min, f32 v_max)
+// Bound on the relative error of n chained f32 operations, see pbrt 3.9
+inline f32 error_gamma(int n)
 {
-    return v_min + (v_max - v_min) * rand01();
+    const f32 e = n * FLT_EPSILON * 0.5f;
+    return e / (1.f - e);
 }
 
-inline f32 clamp(f32 v, f32 a, f32 b)
-{
-    return (v < a) ? a : ((v > b) ? b : v);
-}
+// rand01 and rand_range, per thread and reproducible, see rng.h
+#include "rng.h"
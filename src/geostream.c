@@ -0,0 +1,723 @@
+#include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+#include "geostream.h"
+
+#define WIN32_LEAN_AND_MEAN
+#include "windows.h"
+
+
+// Utils
+#define GEO_FILE_MAGIC 0x4F454753 // 'SGEO'
+#define GEO_FILE_VERSION 2
+#define GEO_CHUNK_ALIGN 65536     // allocation granularity, views have to start on it
+#define GEO_BLOCK_OBJECTS 64      // objects per cell buffered by the writer
+#define GEO_MAX_CELLS 1024        // per axis, keeps the top level tree shallow
+#define GEO_MAX_DEPTH 64
+#define FNV_OFFSET 0xCBF29CE484222325ull
+#define FNV_PRIME 0x100000001B3ull
+
+typedef struct geo_file_header
+{
+    unsigned int magic;
+    int version;
+    int chunks_count;
+    int top_nodes_count;
+    long long table_offset; // chunk table, then the top level nodes
+    unsigned long long content_hash;
+} geo_file_header;
+
+typedef struct geo_chunk_entry
+{
+    aabb bounds;
+    long long offset;
+    long long bytes;
+    int nodes_count;
+    int objects_count;
+    unsigned long long hash;
+} geo_chunk_entry;
+
+// Top level tree over the grid, ranges of cells are halved until they hold one chunk
+typedef struct geo_top_builder
+{
+    geo_writer* writer;
+    int* cell_chunks; // chunk of every cell and of the oversized objects, -1 when empty
+    geo_chunk_entry* entries;
+    bvh_node* nodes;
+    int nodes_count;
+} geo_top_builder;
+
+// geo_stream_raytest copies the hit material here, the chunk may be unmapped after it
+static __declspec(thread) material stream_hit_material;
+
+static void chunk_view(geo_chunk* chunk, hittable_array_list* view);
+static bool chunk_evict(geo_stream* stream);
+static int  cell_index(geo_writer* writer, hittable* obj);
+static void drop_textures(hittable* obj);
+static bool spill_read(geo_writer* writer, int cell, hittable_array_list* list);
+static int  top_range_chunks(geo_top_builder* b, const int lo[3], const int hi[3], int* chunk);
+static void top_build(geo_top_builder* b, int node_idx, int lo[3], int hi[3]);
+static void spill_path(char* path, size_t size, const char* stream_path);
+static void fnv_bytes(unsigned long long* h, const void* data, size_t size);
+
+
+bool geo_stream_open(geo_stream* stream, const char* path, size_t budget_bytes)
+{
+    memset(stream, 0, sizeof(*stream));
+
+    FILE* file = NULL;
+    fopen_s(&file, path, "rb");
+    if (!file)
+    {
+        fprintf_s(stderr, "Opening geometry stream... FAIL | %s\n", path);
+        return false;
+    }
+
+    geo_file_header header;
+    bool ok = fread(&header, sizeof(header), 1, file) == 1
+        && header.magic == GEO_FILE_MAGIC
+        && header.version == GEO_FILE_VERSION
+        && header.chunks_count > 0
+        && header.top_nodes_count > 0
+        && _fseeki64(file, header.table_offset, SEEK_SET) == 0;
+
+    if (ok)
+    {
+        stream->chunks = calloc(header.chunks_count, sizeof(geo_chunk));
+        stream->top_nodes = malloc(header.top_nodes_count * sizeof(bvh_node));
+        if (!stream->chunks || !stream->top_nodes) exit(1);
+
+        for (int i = 0; ok && i < header.chunks_count; ++i)
+        {
+            geo_chunk_entry entry;
+            ok = fread(&entry, sizeof(entry), 1, file) == 1;
+            stream->chunks[i] = (geo_chunk){
+                .bounds = entry.bounds,
+                .offset = entry.offset,
+                .bytes = entry.bytes,
+                .nodes_count = entry.nodes_count,
+                .objects_count = entry.objects_count,
+                .hash = entry.hash
+            };
+        }
+        ok = ok && fread(stream->top_nodes, sizeof(bvh_node), header.top_nodes_count, file) == (size_t)header.top_nodes_count;
+    }
+    fclose(file);
+
+    // chunks are mapped read only on demand, the table above is all that stays resident
+    HANDLE handle = ok ? CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL) : INVALID_HANDLE_VALUE;
+    HANDLE mapping = handle != INVALID_HANDLE_VALUE ? CreateFileMappingA(handle, NULL, PAGE_READONLY, 0, 0, NULL) : NULL;
+    if (!mapping)
+    {
+        if (handle != INVALID_HANDLE_VALUE) CloseHandle(handle);
+        free(stream->chunks);
+        free(stream->top_nodes);
+        memset(stream, 0, sizeof(*stream));
+        fprintf_s(stderr, "Opening geometry stream... FAIL | %s\n", path);
+        return false;
+    }
+
+    SRWLOCK* lock = malloc(sizeof(SRWLOCK));
+    if (!lock) exit(1);
+    InitializeSRWLock(lock);
+
+    stream->chunks_count = header.chunks_count;
+    stream->top_nodes_count = header.top_nodes_count;
+    stream->budget_bytes = budget_bytes;
+    stream->content_hash = header.content_hash;
+    stream->file = handle;
+    stream->mapping = mapping;
+    stream->lock = lock;
+
+    long long objects_count = 0;
+    for (int i = 0; i < stream->chunks_count; ++i) objects_count += stream->chunks[i].objects_count;
+    fprintf_s(stderr, "Opening geometry stream... DONE | %lld objects | %d chunks | %.2f MB budget\n",
+        objects_count, stream->chunks_count, budget_bytes / (1024.0 * 1024.0));
+    return true;
+}
+
+void geo_stream_close(geo_stream* stream)
+{
+    if (!stream->chunks) return;
+
+    for (int i = 0; i < stream->chunks_count; ++i)
+    {
+        if (stream->chunks[i].view) UnmapViewOfFile(stream->chunks[i].view);
+    }
+    CloseHandle(stream->mapping);
+    CloseHandle(stream->file);
+
+    fprintf_s(stderr, "Geometry stream... DONE | %ld page-ins | %.2f MB peak resident\n",
+        stream->page_ins, stream->peak_bytes / (1024.0 * 1024.0));
+
+    free(stream->chunks);
+    free(stream->top_nodes);
+    free(stream->lock);
+    memset(stream, 0, sizeof(*stream));
+}
+
+bool geo_stream_raytest(geo_stream* stream, ray* r, interval t_interval, hit_record* rec)
+{
+    const v3f inv_dir = { .x = 1.f / r->dir.x, .y = 1.f / r->dir.y, .z = 1.f / r->dir.z };
+    bvh_node* nodes = stream->top_nodes;
+    bool hit_anything = false;
+
+    f32 t_enter;
+    if (!bvh_bounds_hit(&nodes[0].bounds, r, inv_dir, t_interval, &t_enter)) return false;
+
+    int stack[GEO_MAX_DEPTH * 2];
+    int top = 0;
+    stack[top++] = 0;
+
+    while (top > 0)
+    {
+        bvh_node* node = &nodes[stack[--top]];
+
+        if (node->count > 0)
+        {
+            // pushed before a closer hit shrank t_max, not worth a page-in anymore
+            if (!bvh_bounds_hit(&node->bounds, r, inv_dir, t_interval, &t_enter)) continue;
+
+            hittable_array_list view;
+            hit_record chunk_rec;
+            geo_stream_acquire(stream, node->left_first, &view);
+            if (bvh_raytest(&view, r, t_interval, &chunk_rec))
+            {
+                stream_hit_material = *chunk_rec.mat;
+                *rec = chunk_rec;
+                rec->mat = &stream_hit_material;
+                rec->obj = NULL;
+                hit_anything = true;
+                t_interval.v_max = rec->t;
+            }
+            geo_stream_release(stream, node->left_first);
+            continue;
+        }
+
+        // deeper than any top tree the writer builds, only a corrupt file gets here
+        if (top + 2 > GEO_MAX_DEPTH * 2) continue;
+
+        f32 t_left, t_right;
+        const bool hit_left = bvh_bounds_hit(&nodes[node->left_first].bounds, r, inv_dir, t_interval, &t_left);
+        const bool hit_right = bvh_bounds_hit(&nodes[node->left_first + 1].bounds, r, inv_dir, t_interval, &t_right);
+
+        if (hit_left && hit_right)
+        {
+            const bool left_first = t_left <= t_right;
+            stack[top++] = left_first ? node->left_first + 1 : node->left_first;
+            stack[top++] = left_first ? node->left_first : node->left_first + 1;
+        }
+        else if (hit_left)
+        {
+            stack[top++] = node->left_first;
+        }
+        else if (hit_right)
+        {
+            stack[top++] = node->left_first + 1;
+        }
+    }
+
+    return hit_anything;
+}
+
+int geo_stream_chunks_hit(
+    geo_stream* stream,
+    ray* r,
+    interval t_interval,
+    int** chunks,
+    f32** t_enter,
+    int* capacity)
+{
+    const v3f inv_dir = { .x = 1.f / r->dir.x, .y = 1.f / r->dir.y, .z = 1.f / r->dir.z };
+    bvh_node* nodes = stream->top_nodes;
+    int count = 0;
+
+    f32 t;
+    if (!bvh_bounds_hit(&nodes[0].bounds, r, inv_dir, t_interval, &t)) return 0;
+
+    int stack[GEO_MAX_DEPTH * 2];
+    int top = 0;
+    stack[top++] = 0;
+
+    while (top > 0)
+    {
+        bvh_node* node = &nodes[stack[--top]];
+
+        if (node->count > 0)
+        {
+            if (!bvh_bounds_hit(&node->bounds, r, inv_dir, t_interval, &t)) continue;
+
+            if (count == *capacity)
+            {
+                *capacity = *capacity ? *capacity * 2 : 16;
+                *chunks = realloc(*chunks, *capacity * sizeof(int));
+                *t_enter = realloc(*t_enter, *capacity * sizeof(f32));
+                if (!*chunks || !*t_enter) exit(1);
+            }
+            (*chunks)[count] = node->left_first;
+            (*t_enter)[count] = t;
+            ++count;
+            continue;
+        }
+
+        // deeper than any top tree the writer builds, only a corrupt file gets here
+        if (top + 2 > GEO_MAX_DEPTH * 2) continue;
+
+        // children missed by the ray are never visited, a ray only walks the chunks along it
+        f32 t_left, t_right;
+        const bool hit_left = bvh_bounds_hit(&nodes[node->left_first].bounds, r, inv_dir, t_interval, &t_left);
+        const bool hit_right = bvh_bounds_hit(&nodes[node->left_first + 1].bounds, r, inv_dir, t_interval, &t_right);
+
+        if (hit_left && hit_right)
+        {
+            const bool left_first = t_left <= t_right;
+            stack[top++] = left_first ? node->left_first + 1 : node->left_first;
+            stack[top++] = left_first ? node->left_first : node->left_first + 1;
+        }
+        else if (hit_left)
+        {
+            stack[top++] = node->left_first;
+        }
+        else if (hit_right)
+        {
+            stack[top++] = node->left_first + 1;
+        }
+    }
+
+    // few chunks per ray, insertion sort by entry distance
+    for (int i = 1; i < count; ++i)
+    {
+        const int chunk = (*chunks)[i];
+        const f32 t_chunk = (*t_enter)[i];
+        int j = i;
+        for (; j > 0 && (*t_enter)[j - 1] > t_chunk; --j)
+        {
+            (*chunks)[j] = (*chunks)[j - 1];
+            (*t_enter)[j] = (*t_enter)[j - 1];
+        }
+        (*chunks)[j] = chunk;
+        (*t_enter)[j] = t_chunk;
+    }
+
+    return count;
+}
+
+void geo_stream_acquire(geo_stream* stream, int chunk_idx, hittable_array_list* view)
+{
+    geo_chunk* chunk = &stream->chunks[chunk_idx];
+
+    // resident chunks only need the shared lock, eviction takes it exclusively
+    AcquireSRWLockShared(stream->lock);
+    if (chunk->view)
+    {
+        InterlockedIncrement(&chunk->refs);
+        chunk->referenced = 1;
+        ReleaseSRWLockShared(stream->lock);
+        chunk_view(chunk, view);
+        return;
+    }
+    ReleaseSRWLockShared(stream->lock);
+
+    AcquireSRWLockExclusive(stream->lock);
+    if (!chunk->view)
+    {
+        while (stream->resident_bytes + chunk->bytes > stream->budget_bytes && chunk_evict(stream)) {}
+
+        chunk->view = MapViewOfFile(
+            stream->mapping,
+            FILE_MAP_READ,
+            (DWORD)(chunk->offset >> 32),
+            (DWORD)(chunk->offset & 0xFFFFFFFF),
+            (size_t)chunk->bytes);
+        if (!chunk->view) exit(1);
+
+        stream->resident_bytes += chunk->bytes;
+        if (stream->resident_bytes > stream->peak_bytes) stream->peak_bytes = stream->resident_bytes;
+        InterlockedIncrement(&stream->page_ins);
+    }
+    InterlockedIncrement(&chunk->refs);
+    chunk->referenced = 1;
+    ReleaseSRWLockExclusive(stream->lock);
+
+    chunk_view(chunk, view);
+}
+
+void geo_stream_release(geo_stream* stream, int chunk_idx)
+{
+    InterlockedDecrement(&stream->chunks[chunk_idx].refs);
+}
+
+bool geo_writer_begin(geo_writer* writer, const char* path, aabb bounds, const int cells[3])
+{
+    memset(writer, 0, sizeof(*writer));
+    writer->path = path;
+    writer->bounds = bounds;
+
+    int cells_count = 1;
+    for (int a = 0; a < 3; ++a)
+    {
+        writer->cells[a] = cells[a] < 1 ? 1 : cells[a] > GEO_MAX_CELLS ? GEO_MAX_CELLS : cells[a];
+        cells_count *= writer->cells[a];
+    }
+
+    char spill[MAX_PATH];
+    spill_path(spill, sizeof(spill), path);
+    FILE* file = NULL;
+    fopen_s(&file, spill, "w+b");
+    if (!file) return false;
+    writer->spill = file;
+
+    // one more bin after the cells for the oversized objects
+    const int bins_count = cells_count + 1;
+    writer->pending = malloc((size_t)bins_count * GEO_BLOCK_OBJECTS * sizeof(hittable));
+    writer->pending_count = calloc(bins_count, sizeof(int));
+    writer->blocks = calloc(bins_count, sizeof(long long*));
+    writer->blocks_count = calloc(bins_count, sizeof(int));
+    writer->blocks_capacity = calloc(bins_count, sizeof(int));
+    if (!writer->pending || !writer->pending_count || !writer->blocks || !writer->blocks_count || !writer->blocks_capacity) exit(1);
+    return true;
+}
+
+void geo_writer_add(geo_writer* writer, hittable* obj)
+{
+    const int cell = cell_index(writer, obj);
+    hittable* block = &writer->pending[(size_t)cell * GEO_BLOCK_OBJECTS];
+
+    block[writer->pending_count[cell]] = *obj;
+    drop_textures(&block[writer->pending_count[cell]]);
+    ++writer->pending_count[cell];
+    ++writer->objects_count;
+    if (writer->pending_count[cell] < GEO_BLOCK_OBJECTS) return;
+
+    // full block, appended to the spill file and read back per cell at the end
+    if (writer->blocks_count[cell] == writer->blocks_capacity[cell])
+    {
+        writer->blocks_capacity[cell] = writer->blocks_capacity[cell] ? writer->blocks_capacity[cell] * 2 : 4;
+        writer->blocks[cell] = realloc(writer->blocks[cell], writer->blocks_capacity[cell] * sizeof(long long));
+        if (!writer->blocks[cell]) exit(1);
+    }
+    writer->blocks[cell][writer->blocks_count[cell]++] = writer->spill_bytes;
+    if (fwrite(block, sizeof(hittable), GEO_BLOCK_OBJECTS, writer->spill) != GEO_BLOCK_OBJECTS) writer->failed = true;
+    writer->spill_bytes += GEO_BLOCK_OBJECTS * sizeof(hittable);
+    writer->pending_count[cell] = 0;
+}
+
+bool geo_writer_end(geo_writer* writer)
+{
+    const int cells_count = writer->cells[0] * writer->cells[1] * writer->cells[2];
+    const int bins_count = cells_count + 1;
+    geo_top_builder b = {
+        .writer = writer,
+        .cell_chunks = malloc(bins_count * sizeof(int)),
+        .entries = malloc(bins_count * sizeof(geo_chunk_entry)),
+        .nodes = malloc((2 * bins_count - 1) * sizeof(bvh_node)),
+        .nodes_count = 1
+    };
+    if (!b.cell_chunks || !b.entries || !b.nodes) exit(1);
+
+    FILE* file = NULL;
+    fopen_s(&file, writer->path, "wb");
+    bool ok = file != NULL && !writer->failed;
+
+    // the header goes last so an interrupted write never looks like a stream
+    geo_file_header header = { .content_hash = FNV_OFFSET };
+    ok = ok && fwrite(&header, sizeof(header), 1, file) == 1;
+
+    // one cell at a time, only its objects are in memory while its bvh is built
+    int chunks_count = 0;
+    long long offset = GEO_CHUNK_ALIGN;
+    for (int cell = 0; cell < bins_count; ++cell) b.cell_chunks[cell] = -1;
+    for (int cell = 0; ok && cell < bins_count; ++cell)
+    {
+        if (writer->blocks_count[cell] == 0 && writer->pending_count[cell] == 0) continue;
+
+        hittable_array_list list;
+        hittable_array_list_init(&list);
+        if (!spill_read(writer, cell, &list))
+        {
+            hittable_array_list_delete(&list);
+            ok = false;
+            break;
+        }
+        bvh_build(&list);
+
+        const long long nodes_bytes = list.bvh_nodes_count * sizeof(bvh_node);
+        const long long objects_bytes = list.size * sizeof(hittable);
+        // raw bytes, so a rewrite with uninitialized padding may only miss, never match wrongly
+        unsigned long long hash = FNV_OFFSET;
+        fnv_bytes(&hash, list.bvh_nodes, nodes_bytes);
+        fnv_bytes(&hash, list.data, objects_bytes);
+        fnv_bytes(&header.content_hash, &hash, sizeof(hash));
+
+        b.entries[chunks_count] = (geo_chunk_entry){
+            .bounds = list.bvh_nodes[0].bounds,
+            .offset = offset,
+            .bytes = nodes_bytes + objects_bytes,
+            .nodes_count = (int)list.bvh_nodes_count,
+            .objects_count = (int)list.size,
+            .hash = hash
+        };
+        b.cell_chunks[cell] = chunks_count++;
+
+        ok = _fseeki64(file, offset, SEEK_SET) == 0
+            && fwrite(list.bvh_nodes, sizeof(bvh_node), list.bvh_nodes_count, file) == list.bvh_nodes_count
+            && fwrite(list.data, sizeof(hittable), list.size, file) == list.size;
+        offset = (offset + nodes_bytes + objects_bytes + GEO_CHUNK_ALIGN - 1) / GEO_CHUNK_ALIGN * GEO_CHUNK_ALIGN;
+
+        hittable_array_list_delete(&list);
+    }
+
+    if (ok && chunks_count > 0)
+    {
+        // the oversized chunk overlaps everything, it sits next to the grid under the root
+        int lo[3] = { 0, 0, 0 };
+        int hi[3] = { writer->cells[0], writer->cells[1], writer->cells[2] };
+        const int oversized = b.cell_chunks[cells_count];
+        if (oversized < 0)
+        {
+            top_build(&b, 0, lo, hi);
+        }
+        else if (chunks_count == 1)
+        {
+            b.nodes[0] = (bvh_node){ .bounds = b.entries[oversized].bounds, .left_first = oversized, .count = 1 };
+        }
+        else
+        {
+            b.nodes_count = 3;
+            top_build(&b, 1, lo, hi);
+            b.nodes[2] = (bvh_node){ .bounds = b.entries[oversized].bounds, .left_first = oversized, .count = 1 };
+            b.nodes[0] = (bvh_node){
+                .bounds = aabb_union(b.nodes[1].bounds, b.nodes[2].bounds),
+                .left_first = 1,
+                .count = 0
+            };
+        }
+
+        header = (geo_file_header){
+            .magic = GEO_FILE_MAGIC,
+            .version = GEO_FILE_VERSION,
+            .chunks_count = chunks_count,
+            .top_nodes_count = b.nodes_count,
+            .table_offset = offset,
+            .content_hash = header.content_hash
+        };
+        ok = _fseeki64(file, offset, SEEK_SET) == 0
+            && fwrite(b.entries, sizeof(geo_chunk_entry), chunks_count, file) == (size_t)chunks_count
+            && fwrite(b.nodes, sizeof(bvh_node), b.nodes_count, file) == (size_t)b.nodes_count
+            && _fseeki64(file, 0, SEEK_SET) == 0
+            && fwrite(&header, sizeof(header), 1, file) == 1;
+    }
+    else
+    {
+        ok = false;
+    }
+    if (file) ok = fclose(file) == 0 && ok;
+
+    char spill[MAX_PATH];
+    spill_path(spill, sizeof(spill), writer->path);
+    fclose(writer->spill);
+    DeleteFileA(spill);
+
+    fprintf_s(stderr, "Writing geometry stream... %s | %lld objects | %d chunks | %.2f MB\n",
+        ok ? "DONE" : "FAIL", writer->objects_count, chunks_count, offset / (1024.0 * 1024.0));
+
+    for (int cell = 0; cell < bins_count; ++cell) free(writer->blocks[cell]);
+    free(writer->pending);
+    free(writer->pending_count);
+    free(writer->blocks);
+    free(writer->blocks_count);
+    free(writer->blocks_capacity);
+    free(b.cell_chunks);
+    free(b.entries);
+    free(b.nodes);
+    memset(writer, 0, sizeof(*writer));
+    return ok;
+}
+
+void chunk_view(geo_chunk* chunk, hittable_array_list* view)
+{
+    // nodes first, objects right behind them, both used in place
+    *view = (hittable_array_list){
+        .size = chunk->objects_count,
+        .capacity = chunk->objects_count,
+        .data = (hittable*)((char*)chunk->view + chunk->nodes_count * sizeof(bvh_node)),
+        .bvh_nodes = chunk->view,
+        .bvh_nodes_count = chunk->nodes_count
+    };
+}
+
+bool chunk_evict(geo_stream* stream)
+{
+    // clock sweep, a chunk touched since the last pass gets a second chance
+    for (int step = 0; step < 2 * stream->chunks_count; ++step)
+    {
+        geo_chunk* chunk = &stream->chunks[stream->hand];
+        stream->hand = (stream->hand + 1) % stream->chunks_count;
+        if (!chunk->view || chunk->refs > 0) continue;
+        if (chunk->referenced)
+        {
+            chunk->referenced = 0;
+            continue;
+        }
+
+        UnmapViewOfFile(chunk->view);
+        chunk->view = NULL;
+        stream->resident_bytes -= chunk->bytes;
+        return true;
+    }
+    return false;
+}
+
+int cell_index(geo_writer* writer, hittable* obj)
+{
+    const aabb bounds = hittable_bounds(obj);
+    const p3f p = aabb_centroid(bounds);
+    int idx[3];
+    for (int a = 0; a < 3; ++a)
+    {
+        const f32 extent = writer->bounds.hi.e[a] - writer->bounds.lo.e[a];
+
+        // larger than a cell, binned with the other oversized objects
+        if (extent > 0.f && bounds.hi.e[a] - bounds.lo.e[a] > extent / writer->cells[a])
+        {
+            return writer->cells[0] * writer->cells[1] * writer->cells[2];
+        }
+
+        const int k = extent > 0.f ? (int)((p.e[a] - writer->bounds.lo.e[a]) / extent * writer->cells[a]) : 0;
+        idx[a] = k < 0 ? 0 : k >= writer->cells[a] ? writer->cells[a] - 1 : k;
+    }
+    return (idx[2] * writer->cells[1] + idx[1]) * writer->cells[0] + idx[0];
+}
+
+void drop_textures(hittable* obj)
+{
+    material* mat = NULL;
+    switch (obj->type)
+    {
+#define X_HITTABLE_MATERIAL(NAME, type, member) case EHittableType_##NAME: mat = &obj->member.mat; break;
+    HITTABLE_TYPES(X_HITTABLE_MATERIAL)
+#undef X_HITTABLE_MATERIAL
+    default: return;
+    }
+
+    // pointers do not survive the file
+    if (mat->type == EMaterialType_LAMBERTIAN)
+    {
+        mat->lambertian.albedo_tex = NULL;
+    }
+    else if (mat->type == EMaterialType_METAL)
+    {
+        mat->metal.albedo_tex = NULL;
+        mat->metal.roughness_tex = NULL;
+    }
+}
+
+bool spill_read(geo_writer* writer, int cell, hittable_array_list* list)
+{
+    hittable block[GEO_BLOCK_OBJECTS];
+    for (int i = 0; i < writer->blocks_count[cell]; ++i)
+    {
+        if (_fseeki64(writer->spill, writer->blocks[cell][i], SEEK_SET) != 0
+            || fread(block, sizeof(hittable), GEO_BLOCK_OBJECTS, writer->spill) != GEO_BLOCK_OBJECTS)
+        {
+            return false;
+        }
+        for (int k = 0; k < GEO_BLOCK_OBJECTS; ++k) hittable_array_list_add(list, block[k]);
+    }
+
+    hittable* pending = &writer->pending[(size_t)cell * GEO_BLOCK_OBJECTS];
+    for (int k = 0; k < writer->pending_count[cell]; ++k) hittable_array_list_add(list, pending[k]);
+    return true;
+}
+
+int top_range_chunks(geo_top_builder* b, const int lo[3], const int hi[3], int* chunk)
+{
+    int count = 0;
+    for (int z = lo[2]; z < hi[2]; ++z)
+    {
+        for (int y = lo[1]; y < hi[1]; ++y)
+        {
+            for (int x = lo[0]; x < hi[0]; ++x)
+            {
+                const int c = b->cell_chunks[(z * b->writer->cells[1] + y) * b->writer->cells[0] + x];
+                if (c < 0) continue;
+                *chunk = c;
+                ++count;
+            }
+        }
+    }
+    return count;
+}
+
+void top_build(geo_top_builder* b, int node_idx, int lo[3], int hi[3])
+{
+    // the range holds at least one chunk, empty halves are dropped without a node
+    for (;;)
+    {
+        int chunk = -1;
+        if (top_range_chunks(b, lo, hi, &chunk) == 1)
+        {
+            b->nodes[node_idx] = (bvh_node){ .bounds = b->entries[chunk].bounds, .left_first = chunk, .count = 1 };
+            return;
+        }
+
+        int axis = 0;
+        for (int a = 1; a < 3; ++a)
+        {
+            if (hi[a] - lo[a] > hi[axis] - lo[axis]) axis = a;
+        }
+        const int mid = (lo[axis] + hi[axis]) / 2;
+
+        int left_lo[3] = { lo[0], lo[1], lo[2] };
+        int left_hi[3] = { hi[0], hi[1], hi[2] };
+        int right_lo[3] = { lo[0], lo[1], lo[2] };
+        int right_hi[3] = { hi[0], hi[1], hi[2] };
+        left_hi[axis] = mid;
+        right_lo[axis] = mid;
+
+        int unused;
+        const bool left_empty = top_range_chunks(b, left_lo, left_hi, &unused) == 0;
+        const bool right_empty = top_range_chunks(b, right_lo, right_hi, &unused) == 0;
+        if (left_empty || right_empty)
+        {
+            if (left_empty) lo[axis] = mid;
+            else hi[axis] = mid;
+            continue;
+        }
+
+        const int left_idx = b->nodes_count;
+        b->nodes_count += 2;
+        top_build(b, left_idx, left_lo, left_hi);
+        top_build(b, left_idx + 1, right_lo, right_hi);
+        b->nodes[node_idx] = (bvh_node){
+            .bounds = aabb_union(b->nodes[left_idx].bounds, b->nodes[left_idx + 1].bounds),
+            .left_first = left_idx,
+            .count = 0
+        };
+        return;
+    }
+}
+
+void spill_path(char* path, size_t size, const char* stream_path)
+{
+    sprintf_s(path, size, "%s.spill", stream_path);
+}
+
+void fnv_bytes(unsigned long long* h, const void* data, size_t size)
+{
+    const unsigned char* bytes = data;
+    for (size_t i = 0; i < size; ++i)
+    {
+        *h = (*h ^ bytes[i]) * FNV_PRIME;
+    }
+}
+
+#undef WIN32_LEAN_AND_MEAN
+#undef GEO_FILE_MAGIC
+#undef GEO_FILE_VERSION
+#undef GEO_CHUNK_ALIGN
+#undef GEO_BLOCK_OBJECTS
+#undef GEO_MAX_CELLS
+#undef GEO_MAX_DEPTH
+#undef FNV_OFFSET
+#undef FNV_PRIME
@@ -0,0 +1,98 @@
+#pragma once
+
+#include "stddef.h"
+#include "defs.h"
+#include "aabb.h"
+#include "hittable.h"
+#include "bvh.h"
+#include "ray.h"
+
+typedef struct geo_chunk geo_chunk;
+typedef struct geo_stream geo_stream;
+typedef struct geo_writer geo_writer;
+
+// Out-of-core scenes. The objects are binned into a grid of cells, every cell is one
+// chunk of the file: its BVH nodes followed by its objects, aligned so it can be
+// mapped on its own. Only the chunk table and a small top level tree over the chunk
+// bounds stay in memory, chunks are mapped when traversal reaches them and unmapped
+// again to stay within the budget.
+struct geo_chunk
+{
+    aabb bounds;
+    long long offset;
+    long long bytes;
+    int nodes_count;
+    int objects_count;
+    unsigned long long hash; // of the chunk bytes, see geo_writer_end
+
+    // residency, guarded by the stream lock, refs pin the view
+    void* view;
+    volatile long refs;
+    volatile long referenced;
+};
+
+struct geo_stream
+{
+    geo_chunk* chunks;
+    int chunks_count;
+    bvh_node* top_nodes; // leaves hold one chunk index in left_first
+    int top_nodes_count;
+    size_t budget_bytes; // mapped chunks, exceeded only while every chunk is pinned
+    unsigned long long content_hash; // over all chunk hashes
+
+    // internals
+    void* file;
+    void* mapping;
+    void* lock;
+    size_t resident_bytes;
+    size_t peak_bytes;
+    int hand;
+    volatile long page_ins;
+};
+
+// Streams objects into a grid of cells per axis over bounds, only one small block
+// per cell is kept in memory. Objects larger than a cell go to a chunk of their own
+// so they do not stretch a cell chunk over the whole scene. Textures are not stored,
+// textured materials render with their plain albedo.
+struct geo_writer
+{
+    const char* path;
+    aabb bounds;
+    int cells[3];
+    long long objects_count;
+
+    // internals
+    void* spill;                 // blocks of full cells, read back by geo_writer_end
+    long long spill_bytes;
+    bool failed;                 // a spill write came up short
+    hittable* pending;           // GEO_BLOCK_OBJECTS per cell, the oversized objects last
+    int* pending_count;
+    long long** blocks;          // spill offsets of the blocks of every cell
+    int* blocks_count;
+    int* blocks_capacity;
+};
+
+bool geo_stream_open(geo_stream* stream, const char* path, size_t budget_bytes);
+void geo_stream_close(geo_stream* stream);
+
+// Closest hit over the chunks front to back, pages every chunk in while it is
+// tested. rec->mat points to a per thread copy valid until the next raytest.
+bool geo_stream_raytest(geo_stream* stream, ray* r, interval t_interval, hit_record* rec);
+
+// Chunks whose bounds the ray crosses within t_interval, nearest entry first, with
+// the entry distances. Returns the count, chunks and t_enter are grown as needed.
+int  geo_stream_chunks_hit(
+    geo_stream* stream,
+    ray* r,
+    interval t_interval,
+    int** chunks,
+    f32** t_enter,
+    int* capacity);
+
+// Maps the chunk if needed and pins it, view gets the chunk nodes and objects
+void geo_stream_acquire(geo_stream* stream, int chunk, hittable_array_list* view);
+void geo_stream_release(geo_stream* stream, int chunk);
+
+bool geo_writer_begin(geo_writer* writer, const char* path, aabb bounds, const int cells[3]);
+void geo_writer_add(geo_writer* writer, hittable* obj);
+bool geo_writer_end(geo_writer* writer);
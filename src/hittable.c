@@ -1,9 +1,15 @@
 #include "hittable.h"
 #include "malloc.h"
+#include "string.h"
 #include "process.h"
 
 #define MIN_ARRAY_LIST_SIZE 10
 
+const aabb aabb_empty = {
+    .lo = { .x = INFINITY, .y = INFINITY, .z = INFINITY },
+    .hi = { .x = -INFINITY, .y = -INFINITY, .z = -INFINITY }
+};
+
 void hittable_array_list_init(hittable_array_list* list)
 {
     hittable* data = malloc(sizeof(hittable) * MIN_ARRAY_LIST_SIZE);
@@ -13,6 +19,10 @@ void hittable_array_list_init(hittable_array_list* list)
     list->size = 0;
     list->capacity = MIN_ARRAY_LIST_SIZE;
     list->data = data;
+    list->bucketed = false;
+    list->bvh_nodes = NULL;
+    list->bvh_nodes_count = 0;
+    list->stream = NULL;
 }
 
 void hittable_array_list_delete(hittable_array_list* list)
@@ -21,6 +31,10 @@ void hittable_array_list_delete(hittable_array_list* list)
     list->size = 0;
     list->capacity = 0;
     list->data = NULL;
+    list->bucketed = false;
+    free(list->bvh_nodes);
+    list->bvh_nodes = NULL;
+    list->bvh_nodes_count = 0;
 }
 
 void hittable_array_list_add(hittable_array_list* list, hittable item)
@@ -34,6 +48,99 @@ void hittable_array_list_add(hittable_array_list* list, hittable item)
     }
 
     list->data[list->size++] = item;
+    list->bucketed = false;
+    list->bvh_nodes_count = 0;
+}
+
+void hittable_array_list_bucket_by_type(hittable_array_list* list)
+{
+    size_t counts[EHittableType_COUNT] = { 0 };
+    for (size_t i = 0; i < list->size; ++i) ++counts[list->data[i].type];
+
+    list->type_offsets[0] = 0;
+    for (int t = 0; t < EHittableType_COUNT; ++t)
+    {
+        list->type_offsets[t + 1] = list->type_offsets[t] + counts[t];
+    }
+
+    // stable counting sort, objects keep their relative order inside a bucket
+    hittable* data = malloc(sizeof(hittable) * list->capacity);
+    if (!data) exit(1);
+
+    size_t cursor[EHittableType_COUNT];
+    memcpy(cursor, list->type_offsets, sizeof(cursor));
+    for (size_t i = 0; i < list->size; ++i)
+    {
+        data[cursor[list->data[i].type]++] = list->data[i];
+    }
+
+    free(list->data);
+    list->data = data;
+    list->bucketed = true;
+    list->bvh_nodes_count = 0;
+}
+
+aabb hittable_bounds(hittable* obj)
+{
+    switch (obj->type)
+    {
+#define X_HITTABLE_BOUNDS_CASE(NAME, type, member) \
+    case EHittableType_##NAME: return type##_bounds(&obj->member);
+    HITTABLE_TYPES(X_HITTABLE_BOUNDS_CASE)
+#undef X_HITTABLE_BOUNDS_CASE
+    default: return aabb_empty;
+    }
+}
+
+aabb sphere_bounds(sphere* s)
+{
+    const v3f r = { .x = s->radius, .y = s->radius, .z = s->radius };
+    aabb bounds = { .lo = v3f_sub(s->center, r), .hi = v3f_add(s->center, r) };
+    if (s->is_moving)
+    {
+        bounds = aabb_union(bounds, (aabb) { .lo = v3f_sub(s->center1, r), .hi = v3f_add(s->center1, r) });
+    }
+    return bounds;
+}
+
+p3f sphere_center(sphere* s, f32 time)
+{
+    if (!s->is_moving) return s->center;
+    return v3f_add(s->center, v3f_mul(v3f_sub(s->center1, s->center), time));
+}
+
+quad quad_create(p3f q, v3f u, v3f v, material mat)
+{
+    const v3f n = v3f_cross(u, v);
+    const v3f normal = v3f_unit(n);
+    return (quad) {
+        .q = q,
+        .u = u,
+        .v = v,
+        .mat = mat,
+        .normal = normal,
+        .d = v3f_dot(normal, q),
+        .w = v3f_div(n, v3f_dot(n, n))
+    };
+}
+
+aabb quad_bounds(quad* q)
+{
+    aabb bounds = { .lo = q->q, .hi = q->q };
+    bounds = aabb_expand(bounds, v3f_add(q->q, q->u));
+    bounds = aabb_expand(bounds, v3f_add(q->q, q->v));
+    bounds = aabb_expand(bounds, v3f_add(q->q, v3f_add(q->u, q->v)));
+    return bounds;
+}
+
+aabb box_bounds(box* b)
+{
+    return b->bounds;
+}
+
+aabb medium_bounds(medium* m)
+{
+    return m->boundary;
 }
 
 #undef MIN_ARRAY_LIST_SIZE
@@ -4,29 +4,86 @@
 #include "defs.h"
 #include "vec3f.h"
 #include "material.h"
+#include "aabb.h"
 
 typedef struct hit_record hit_record;
 struct hit_record
 {
     p3f p;
+    v3f p_error; // bound on the absolute error of p per axis
     v3f normal;
     f32 t;
+    f32 u;
+    f32 v;
+    f32 footprint; // ray footprint in uv units, selects the texture mip level
     bool front_face;
     material* mat;
+    int obj_type;  // EHittableType of obj
+    void* obj;
 };
 
 typedef struct sphere sphere;
 struct sphere
 {
     p3f center;
+    p3f center1; // center at time 1 when moving
+    bool is_moving;
     f32 radius;
     material mat;
 };
 
+// Parallelogram q + a u + b v for a, b in [0, 1], see quad_create
+typedef struct quad quad;
+struct quad
+{
+    p3f q;
+    v3f u;
+    v3f v;
+    material mat;
+
+    // derived from q, u, v
+    v3f normal; // unit normal of the plane, u x v
+    f32 d;      // plane offset, dot(normal, q)
+    v3f w;      // (u x v) / |u x v|^2, maps plane points to a, b
+};
+
+// Axis aligned box
+typedef struct box box;
+struct box
+{
+    aabb bounds;
+    material mat;
+};
+
+// Participating medium of constant density filling an axis aligned box, rays
+// scatter inside after an exponentially distributed distance. mat is the phase
+// function, usually isotropic.
+typedef struct medium medium;
+struct medium
+{
+    aabb boundary;
+    f32 density;
+    material mat;
+};
+
+// X(NAME, type, member) for every primitive. Adding an entry generates the enum value,
+// the union member, the ray_hit, bounds and uv dispatch and the type-homogeneous
+// raytest kernel, the primitive itself only needs ray_hit_<type> and <type>_surface_uv
+// routines in ray.c, a <type>_bounds routine in hittable.c and a hash_<type> routine
+// in rendercache.c.
+#define HITTABLE_TYPES(X) \
+    X(SPHERE, sphere, s) \
+    X(QUAD, quad, q) \
+    X(BOX, box, b) \
+    X(MEDIUM, medium, m)
+
 typedef enum EHittableType EHittableType;
 enum EHittableType
 {
-    EHittableType_SPHERE
+#define X_HITTABLE_ENUM(NAME, type, member) EHittableType_##NAME,
+    HITTABLE_TYPES(X_HITTABLE_ENUM)
+#undef X_HITTABLE_ENUM
+    EHittableType_COUNT
 };
 
 typedef struct hittable hittable;
@@ -36,7 +93,9 @@ struct hittable
 
     union
     {
-        sphere s;
+#define X_HITTABLE_MEMBER(NAME, type, member) type member;
+        HITTABLE_TYPES(X_HITTABLE_MEMBER)
+#undef X_HITTABLE_MEMBER
     };
 };
 
@@ -46,8 +105,29 @@ struct hittable_array_list
     size_t size;
     size_t capacity;
     hittable* data;
+
+    // objects of type t are in [type_offsets[t], type_offsets[t + 1]) when bucketed
+    bool bucketed;
+    size_t type_offsets[EHittableType_COUNT + 1];
+
+    // acceleration structure over data, see bvh.h, empty when bvh_nodes_count is 0
+    struct bvh_node* bvh_nodes;
+    size_t bvh_nodes_count;
+
+    // out-of-core geometry, see geostream.h, data and bvh stay empty when set
+    struct geo_stream* stream;
 };
 
+// Bounds enclosing the object over the whole shutter interval
+#define X_HITTABLE_BOUNDS_DECL(NAME, type, member) aabb type##_bounds(type* obj);
+HITTABLE_TYPES(X_HITTABLE_BOUNDS_DECL)
+#undef X_HITTABLE_BOUNDS_DECL
+
+aabb hittable_bounds(hittable* obj);
+p3f  sphere_center(sphere* s, f32 time);
+quad quad_create(p3f q, v3f u, v3f v, material mat);
+
 void hittable_array_list_init(hittable_array_list* list);
 void hittable_array_list_delete(hittable_array_list* list);
 void hittable_array_list_add(hittable_array_list* list, hittable item);
+void hittable_array_list_bucket_by_type(hittable_array_list* list);
@@ -0,0 +1,164 @@
+#include "stdlib.h"
+#include "string.h"
+#include "malloc.h"
+#include "math.h"
+#include "irradiance.h"
+
+// Utils
+#define IRRADIANCE_BUCKETS 65536
+#define MIN_RECORDS_CAPACITY 256
+#define COVERED_NORMAL_DOT 0.9f
+
+static int      cell_of(f32 v, f32 spacing);
+static unsigned cell_hash(int x, int y, int z);
+static int      bucket_of(const irradiance_cache* cache, p3f p);
+
+
+void irradiance_cache_init(irradiance_cache* cache, f32 spacing, f32 error)
+{
+    cache->records = malloc(MIN_RECORDS_CAPACITY * sizeof(irradiance_record));
+    cache->buckets = malloc(IRRADIANCE_BUCKETS * sizeof(int));
+    if (!cache->records || !cache->buckets) exit(1);
+
+    memset(cache->buckets, 0xFF, IRRADIANCE_BUCKETS * sizeof(int));
+    cache->records_count = 0;
+    cache->records_capacity = MIN_RECORDS_CAPACITY;
+    cache->buckets_mask = IRRADIANCE_BUCKETS - 1;
+    cache->spacing = spacing;
+
+    // records are at most spacing wide, lookups only visit the neighbouring cells
+    cache->error = clamp(error, 0.01f, 1.f);
+}
+
+void irradiance_cache_delete(irradiance_cache* cache)
+{
+    free(cache->records);
+    free(cache->buckets);
+    cache->records = NULL;
+    cache->buckets = NULL;
+    cache->records_count = 0;
+    cache->records_capacity = 0;
+}
+
+int irradiance_cache_add(irradiance_cache* cache, p3f p, v3f normal)
+{
+    const int cx = cell_of(p.x, cache->spacing);
+    const int cy = cell_of(p.y, cache->spacing);
+    const int cz = cell_of(p.z, cache->spacing);
+    const f32 covered = cache->spacing * 0.5f;
+
+    for (int dz = -1; dz <= 1; ++dz)
+    for (int dy = -1; dy <= 1; ++dy)
+    for (int dx = -1; dx <= 1; ++dx)
+    {
+        const int bucket = cell_hash(cx + dx, cy + dy, cz + dz) & cache->buckets_mask;
+        for (int i = cache->buckets[bucket]; i >= 0; i = cache->records[i].next)
+        {
+            const irradiance_record* rec = &cache->records[i];
+            if (v3f_length(v3f_sub(p, rec->p)) < covered && v3f_dot(normal, rec->normal) > COVERED_NORMAL_DOT)
+            {
+                return -1;
+            }
+        }
+    }
+
+    if (cache->records_count >= cache->records_capacity)
+    {
+        irradiance_record* records = realloc(
+            cache->records, cache->records_capacity * 2 * sizeof(irradiance_record));
+        if (!records) exit(1);
+        cache->records = records;
+        cache->records_capacity *= 2;
+    }
+
+    const int bucket = bucket_of(cache, p);
+    const int index = cache->records_count++;
+    cache->records[index] = (irradiance_record){
+        .p = p,
+        .normal = normal,
+        .radiance = { .r = 0.f, .g = 0.f, .b = 0.f },
+        .radius = cache->spacing,
+        .next = cache->buckets[bucket]
+    };
+    cache->buckets[bucket] = index;
+    return index;
+}
+
+size_t irradiance_cache_bytes(int records_count)
+{
+    // the records array doubles, it is at most twice as large as needed
+    size_t capacity = MIN_RECORDS_CAPACITY;
+    while (capacity < (size_t)records_count) capacity *= 2;
+    return sizeof(irradiance_cache) + capacity * sizeof(irradiance_record) + IRRADIANCE_BUCKETS * sizeof(int);
+}
+
+bool irradiance_cache_lookup(const irradiance_cache* cache, p3f p, v3f normal, c3f* radiance)
+{
+    const int cx = cell_of(p.x, cache->spacing);
+    const int cy = cell_of(p.y, cache->spacing);
+    const int cz = cell_of(p.z, cache->spacing);
+
+    c3f sum = { .r = 0.f, .g = 0.f, .b = 0.f };
+    f32 weights = 0.f;
+
+    for (int dz = -1; dz <= 1; ++dz)
+    for (int dy = -1; dy <= 1; ++dy)
+    for (int dx = -1; dx <= 1; ++dx)
+    {
+        const int bucket = cell_hash(cx + dx, cy + dy, cz + dz) & cache->buckets_mask;
+        for (int i = cache->buckets[bucket]; i >= 0; i = cache->records[i].next)
+        {
+            const irradiance_record* rec = &cache->records[i];
+
+            // buckets are shared by colliding cells, count every record once
+            if (cell_of(rec->p.x, cache->spacing) != cx + dx
+                || cell_of(rec->p.y, cache->spacing) != cy + dy
+                || cell_of(rec->p.z, cache->spacing) != cz + dz)
+            {
+                continue;
+            }
+
+            const v3f d = v3f_sub(p, rec->p);
+            const f32 dist = v3f_length(d);
+            if (dist >= rec->radius * cache->error) continue;
+
+            // Ward's error estimate, the record is used while it stays below a
+            const f32 e = dist / rec->radius + sqrtf(fmaxf(0.f, 1.f - v3f_dot(normal, rec->normal)));
+            if (e >= cache->error) continue;
+
+            // records behind p see geometry p itself may occlude
+            if (v3f_dot(d, v3f_add(normal, rec->normal)) < -0.1f * rec->radius) continue;
+
+            const f32 w = 1.f / fmaxf(e, 1e-4f);
+            sum = v3f_add(sum, v3f_mul(rec->radiance, w));
+            weights += w;
+        }
+    }
+
+    if (weights <= 0.f) return false;
+
+    *radiance = v3f_div(sum, weights);
+    return true;
+}
+
+int cell_of(f32 v, f32 spacing)
+{
+    return (int)floorf(v / spacing);
+}
+
+unsigned cell_hash(int x, int y, int z)
+{
+    return ((unsigned)x * 73856093u) ^ ((unsigned)y * 19349663u) ^ ((unsigned)z * 83492791u);
+}
+
+int bucket_of(const irradiance_cache* cache, p3f p)
+{
+    return cell_hash(
+        cell_of(p.x, cache->spacing),
+        cell_of(p.y, cache->spacing),
+        cell_of(p.z, cache->spacing)) & cache->buckets_mask;
+}
+
+#undef IRRADIANCE_BUCKETS
+#undef MIN_RECORDS_CAPACITY
+#undef COVERED_NORMAL_DOT
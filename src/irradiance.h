@@ -0,0 +1,45 @@
+#pragma once
+
+#include "stddef.h"
+#include "defs.h"
+#include "vec3f.h"
+
+typedef struct irradiance_record irradiance_record;
+typedef struct irradiance_cache irradiance_cache;
+
+// Mean incoming radiance over the cosine weighted hemisphere around normal at p,
+// a lambertian surface there reflects albedo * radiance.
+struct irradiance_record
+{
+    p3f p;
+    v3f normal;
+    c3f radiance;
+    f32 radius; // harmonic mean distance of the sampled hits, validity radius
+    int next;   // next record of the hash bucket, -1 ends the chain
+};
+
+// Records on a world space grid of spacing sized cells, hashed into buckets.
+// Filled by the camera pre-pass, afterwards it is only read, without locks.
+struct irradiance_cache
+{
+    irradiance_record* records;
+    int records_count;
+    int records_capacity;
+    int* buckets;
+    int buckets_mask;
+    f32 spacing;
+    f32 error; // Ward's a, larger values reuse records further away
+};
+
+void irradiance_cache_init(irradiance_cache* cache, f32 spacing, f32 error);
+void irradiance_cache_delete(irradiance_cache* cache);
+
+// Adds a record without radiance yet, returns its index or -1 when an existing
+// record already covers p
+int  irradiance_cache_add(irradiance_cache* cache, p3f p, v3f normal);
+
+// Weighted mean of the records valid at p within the error bound
+bool irradiance_cache_lookup(const irradiance_cache* cache, p3f p, v3f normal, c3f* radiance);
+
+// Bytes allocated by a cache once records_count records were added
+size_t irradiance_cache_bytes(int records_count);
@@ -1,20 +1,210 @@
 #include "stdlib.h"
 #include "stdio.h"
+#include "string.h"
 #include "defs.h"
 #include "vec3f.h"
 #include "camera.h"
 #include "hittable.h"
 #include "material.h"
+#include "preview.h"
+#include "bvh.h"
+#include "texture.h"
+#include "tonemap.h"
+#include "telemetry.h"
+#include "scenestats.h"
+#include "rendercache.h"
+#include "geostream.h"
+#include "math.h"
 
 
 void save_as_ppm(
     const char* filename,
     int image_width,
     int image_height,
-    c3f* framebuffer);
+    unsigned char* pixels);
 
-int main(void)
+void save_tonemapped(
+    const char* filename,
+    int image_width,
+    int image_height,
+    c3f* hdr,
+    tonemap_settings* settings);
+
+// Renders with 1, one per cpu and 4 per cpu workers, true when all are bit-identical
+bool verify_determinism(camera* cam, hittable_array_list* world);
+
+// Material of the small random spheres, choose_mat in [0, 1) picks the type
+material random_sphere_material(f32 choose_mat);
+
+// Writes the default scene grown to count small spheres as a geometry stream, the
+// spheres go straight to the writer so the field never has to fit in memory
+bool write_sphere_field(const char* path, long long count);
+
+// AOV file suffixes, see CAMERA_AOV_COUNT
+const char* aov_names[CAMERA_AOV_COUNT] = {
+#define X_AOV_NAME(NAME, member) #member,
+    MATERIAL_TYPES(X_AOV_NAME)
+#undef X_AOV_NAME
+    "background"
+};
+
+int main(int argc, char** argv)
 {
+    pixel_rect crop = { 0 };
+    bool preview_mode = false;
+    bool ray_batching = false;
+    bool motion_blur = false;
+    bool extra_primitives = false;
+    const char* sphere_texture_path = NULL;
+    int texture_cache_mb = 256;
+    const char* stats_path = NULL;
+    bool aovs = false;
+    f32 irradiance_error = 0.f;
+    tonemap_settings tonemap = { .exposure = 0.f, .op = ETonemapOperator_CLAMP };
+    const char* tonemap_input = NULL;
+    const char* tonemap_output = NULL;
+    int memory_budget_mb = 0;
+    bool calibrate = false;
+    bool deterministic = false;
+    bool check_determinism = false;
+    const char* render_cache_dir = NULL;
+    const char* stream_path = NULL;
+    const char* stream_output = NULL;
+    long long stream_objects = 0;
+    int stream_budget_mb = 1024;
+    for (int i = 1; i < argc; ++i)
+    {
+        if (strcmp(argv[i], "--preview") == 0)
+        {
+            preview_mode = true;
+        }
+        else if (strcmp(argv[i], "--ray-batching") == 0)
+        {
+            ray_batching = true;
+        }
+        else if (strcmp(argv[i], "--motion-blur") == 0)
+        {
+            motion_blur = true;
+        }
+        else if (strcmp(argv[i], "--extra-primitives") == 0)
+        {
+            extra_primitives = true;
+        }
+        else if (strcmp(argv[i], "--sphere-texture") == 0 && i + 1 < argc)
+        {
+            sphere_texture_path = argv[++i];
+        }
+        else if (strcmp(argv[i], "--texture-cache-mb") == 0 && i + 1 < argc)
+        {
+            texture_cache_mb = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--stats") == 0 && i + 1 < argc)
+        {
+            stats_path = argv[++i];
+        }
+        else if (strcmp(argv[i], "--aovs") == 0)
+        {
+            aovs = true;
+        }
+        else if (strcmp(argv[i], "--irradiance-cache") == 0 && i + 1 < argc)
+        {
+            irradiance_error = (f32)atof(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--exposure") == 0 && i + 1 < argc)
+        {
+            tonemap.exposure = (f32)atof(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--tonemap-op") == 0 && i + 1 < argc)
+        {
+            if (!tonemap_parse_operator(argv[++i], &tonemap.op))
+            {
+                fprintf_s(stderr, "Unknown tone mapping operator %s\n", argv[i]);
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "--tonemap") == 0 && i + 2 < argc)
+        {
+            tonemap_input = argv[i + 1];
+            tonemap_output = argv[i + 2];
+            i += 2;
+        }
+        else if (strcmp(argv[i], "--memory-budget-mb") == 0 && i + 1 < argc)
+        {
+            memory_budget_mb = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--calibrate") == 0)
+        {
+            calibrate = true;
+        }
+        else if (strcmp(argv[i], "--deterministic") == 0)
+        {
+            deterministic = true;
+        }
+        else if (strcmp(argv[i], "--verify-determinism") == 0)
+        {
+            deterministic = true;
+            check_determinism = true;
+        }
+        else if (strcmp(argv[i], "--render-cache") == 0 && i + 1 < argc)
+        {
+            render_cache_dir = argv[++i];
+        }
+        else if (strcmp(argv[i], "--stream-scene") == 0 && i + 1 < argc)
+        {
+            stream_path = argv[++i];
+        }
+        else if (strcmp(argv[i], "--stream-budget-mb") == 0 && i + 1 < argc)
+        {
+            stream_budget_mb = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--write-stream-scene") == 0 && i + 2 < argc)
+        {
+            stream_output = argv[i + 1];
+            stream_objects = atoll(argv[i + 2]);
+            i += 2;
+        }
+        else if (strcmp(argv[i], "--crop") == 0 && i + 4 < argc)
+        {
+            crop = (pixel_rect){
+                .x = atoi(argv[i + 1]),
+                .y = atoi(argv[i + 2]),
+                .width = atoi(argv[i + 3]),
+                .height = atoi(argv[i + 4])
+            };
+            i += 4;
+        }
+    }
+
+    // post stage only, re-run the display transform on a saved render
+    if (tonemap_input)
+    {
+        int width = 0, height = 0;
+        c3f* hdr = hdr_load_pfm(tonemap_input, &width, &height);
+        if (!hdr)
+        {
+            fprintf_s(stderr, "Loading PFM file... FAIL\n");
+            return 1;
+        }
+
+        save_tonemapped(tonemap_output, width, height, hdr, &tonemap);
+        free(hdr);
+        return 0;
+    }
+
+    // scene preparation only, the stream is rendered by a later run with --stream-scene
+    if (stream_output)
+    {
+        return write_sphere_field(stream_output, stream_objects) ? 0 : 1;
+    }
+
+    // the cache budget is only reserved when there is a texture to page in
+    texture* sphere_texture = NULL;
+    if (sphere_texture_path)
+    {
+        texture_cache_init((size_t)texture_cache_mb * 1024 * 1024);
+        sphere_texture = texture_create(sphere_texture_path);
+    }
+
     material material_ground = {
         .type = EMaterialType_LAMBERTIAN,
         .lambertian = {.albedo = {.r = 0.5f, .g = 0.5f, .b = 0.5f}}
@@ -39,13 +229,14 @@ int main(void)
     hittable_array_list world;
     hittable_array_list_init(&world);
 
+    // flat ground, one plane test instead of the quadratic of a huge sphere
     hittable_array_list_add(&world, (hittable) {
-        .type = EHittableType_SPHERE,
-        .s = (sphere){
-            .center = {.x = 0, .y = -1000.f, .z = 0},
-            .radius = 1000.f,
-            .mat = material_ground
-        }
+        .type = EHittableType_QUAD,
+        .q = quad_create(
+            (p3f){.x = -1000.f, .y = 0.f, .z = -1000.f},
+            (v3f){.x = 0.f, .y = 0.f, .z = 2000.f},
+            (v3f){.x = 2000.f, .y = 0.f, .z = 0.f},
+            material_ground)
     });
 
     for (int a = -11; a < 11; ++a)
@@ -61,43 +252,18 @@ int main(void)
 
             if (v3f_length(v3f_sub(center, (p3f) { .x = 4.f, .y = 0.2f, .z = 0.f })) > 0.9f)
             {
-                material mat;
-                if (choose_mat < 0.8f)
-                {
-                    mat = (material){
-                        .type = EMaterialType_LAMBERTIAN,
-                        .lambertian = {
-                            .albedo = v3f_mul_comp(
-                                (v3f){rand01(), rand01(), rand01()},
-                                (v3f){rand01(), rand01(), rand01()})
-                        }
-                    };
-                }
-                else if (choose_mat < 0.95f)
-                {
-                    mat = (material){
-                        .type = EMaterialType_METAL,
-                        .metal = {
-                            .albedo = (v3f){
-                                .r = rand_range(0.5f, 1.f),
-                                .g = rand_range(0.5f, 1.f),
-                                .b = rand_range(0.5f, 1.f)
-                            },
-                            .fuzz = rand_range(0.f, 0.5f)
-                        }
-                    };
-                }
-                else
-                {
-                    mat = (material){
-                        .type = EMaterialType_DIELECTRIC,
-                        .dielectric = { .ir = 1.5f }
-                    };
-                }
+                const material mat = random_sphere_material(choose_mat);
+                // diffuse spheres bounce during the shutter interval
+                const bool is_moving = motion_blur && mat.type == EMaterialType_LAMBERTIAN;
+                const p3f center1 = is_moving
+                    ? v3f_add(center, (v3f) { .x = 0.f, .y = rand_range(0.f, 0.5f), .z = 0.f })
+                    : center;
                 hittable_array_list_add(&world, (hittable) {
                     .type = EHittableType_SPHERE,
                         .s = {
                             .center = center,
+                            .center1 = center1,
+                            .is_moving = is_moving,
                             .radius = 0.2f,
                             .mat = mat
                     }
@@ -126,7 +292,10 @@ int main(void)
             .mat = {
                 .type = EMaterialType_LAMBERTIAN,
                 .lambertian = {
-                    .albedo = {.r = 0.4f, .g =0.2f, .b = 0.1f}
+                    .albedo = sphere_texture
+                        ? (c3f){.r = 1.f, .g = 1.f, .b = 1.f}
+                        : (c3f){.r = 0.4f, .g =0.2f, .b = 0.1f},
+                    .albedo_tex = sphere_texture
                 }
             }
         }
@@ -147,6 +316,57 @@ int main(void)
         }
     });
 
+    if (extra_primitives)
+    {
+        hittable_array_list_add(&world, (hittable) {
+            .type = EHittableType_BOX,
+            .b = {
+                .bounds = {
+                    .lo = {.x = 2.f, .y = 0.f, .z = -2.2f},
+                    .hi = {.x = 2.8f, .y = 0.8f, .z = -1.4f}
+                },
+                .mat = {
+                    .type = EMaterialType_METAL,
+                    .metal = {
+                        .albedo = {.r = 0.8f, .g = 0.8f, .b = 0.9f},
+                        .fuzz = 0.1f
+                    }
+                }
+            }
+        });
+
+        hittable_array_list_add(&world, (hittable) {
+            .type = EHittableType_MEDIUM,
+            .m = {
+                .boundary = {
+                    .lo = {.x = -1.5f, .y = 0.f, .z = 1.5f},
+                    .hi = {.x = 1.5f, .y = 0.6f, .z = 3.f}
+                },
+                .density = 1.5f,
+                .mat = {
+                    .type = EMaterialType_ISOTROPIC,
+                    .isotropic = {.albedo = {.r = 0.9f, .g = 0.9f, .b = 0.9f}}
+                }
+            }
+        });
+    }
+
+    // a streamed scene takes the place of the built-in one
+    geo_stream stream = { 0 };
+    if (stream_path)
+    {
+        if (!geo_stream_open(&stream, stream_path, (size_t)stream_budget_mb * 1024 * 1024)) return 1;
+        hittable_array_list_delete(&world);
+        hittable_array_list_init(&world);
+        world.stream = &stream;
+        // batches visit every chunk a few times per bounce instead of once per ray
+        ray_batching = true;
+    }
+    else
+    {
+        bvh_build(&world);
+    }
+
     camera cam = {
         .fov = 20.f,
         .lookfrom = (p3f){.x = 13.f, .y = 2.f, .z = 3.f},
@@ -157,17 +377,138 @@ int main(void)
         .samples_per_px = 500,
         .defocus_angle = 0.6f,
         .focus_dist = 10.f,
+        .shutter_open = 0.f,
+        .shutter_close = motion_blur ? 1.f : 0.f,
         .max_depth = 50,
-        .mt_render = true
+        .mt_render = true,
+        .ray_batching = ray_batching,
+        .aovs = aovs,
+        .deterministic = deterministic,
+        .irradiance_error = irradiance_error,
+        .crop = crop,
+        .stats_path = stats_path
     };
 
     camera_initialize(&cam);
 
-    camera_render(&cam, &world);
+    scene_stats stats;
+    // the texture cache is only allocated when there is a texture to stream
+    scene_stats_collect(&stats, &world, &cam, sphere_texture ? (size_t)texture_cache_mb * 1024 * 1024 : 0);
+    scene_stats_print(&stats);
+
+    // refuse the job before any pass runs, the scheduler can place it on a larger node
+    if (memory_budget_mb > 0 && stats.total_bytes > (size_t)memory_budget_mb * 1024 * 1024)
+    {
+        fprintf_s(stderr, "Memory budget... FAIL | %.2f MB needed, %d MB allowed\n",
+            stats.total_bytes / (1024.0 * 1024.0), memory_budget_mb);
+        camera_delete(&cam);
+        geo_stream_close(&stream);
+        texture_delete(sphere_texture);
+        texture_cache_delete();
+        return 1;
+    }
+
+    if (calibrate) scene_stats_calibrate(&stats, &world, &cam);
+
+    if (check_determinism)
+    {
+        const bool identical = verify_determinism(&cam, &world);
+        camera_delete(&cam);
+        geo_stream_close(&stream);
+        texture_delete(sphere_texture);
+        texture_cache_delete();
+        return identical ? 0 : 1;
+    }
+
+    if (preview_mode)
+    {
+        preview p = {
+            .cam = &cam,
+            .world = &world,
+            .pass_budget_ms = 250,
+            .shared_name = "Local\\raytracer_preview",
+            .output_file = "preview.ppm",
+            .tonemap = tonemap
+        };
+
+        preview_initialize(&p);
+        preview_run(&p);
+        preview_delete(&p);
+
+        camera_delete(&cam);
+        geo_stream_close(&stream);
+        texture_delete(sphere_texture);
+        texture_cache_delete();
+        return 0;
+    }
+
+    // a cached render with fewer samples is resumed, only the missing samples are traced
+    const unsigned long long cache_key = render_cache_dir ? render_cache_key(&world, &cam) : 0;
+    const int cached_samples = render_cache_dir ? render_cache_load(render_cache_dir, cache_key, &cam) : 0;
+    if (cached_samples == 0)
+    {
+        camera_render(&cam, &world);
+    }
+    else if (cached_samples < cam.samples_per_px)
+    {
+        camera_render_pass(&cam, &world, cam.samples_per_px - cached_samples);
+    }
+
+    if (render_cache_dir
+        && cam.accum_samples != cached_samples
+        && !render_cache_store(render_cache_dir, cache_key, &cam))
+    {
+        fprintf_s(stderr, "Saving render cache... FAIL\n");
+    }
+
+    // crop renders are patched into the previous full frame render when there is one
+    c3f* image = cam.framebuffer;
+    c3f* previous = NULL;
+    if (cam.crop.width != cam.image_width || cam.crop.height != cam.image_height)
+    {
+        int width = 0, height = 0;
+        previous = hdr_load_pfm("render.pfm", &width, &height);
+        if (previous && (width != cam.image_width || height != cam.image_height))
+        {
+            free(previous);
+            previous = NULL;
+        }
+        if (previous)
+        {
+            camera_merge_crop(&cam, previous);
+            image = previous;
+        }
+    }
+
+    if (!hdr_save_pfm("render.pfm", cam.image_width, cam.image_height, image))
+    {
+        fprintf_s(stderr, "Saving PFM file... FAIL\n");
+    }
+    save_tonemapped("render.ppm", cam.image_width, cam.image_height, image, &tonemap);
+
+    if (cam.aovs)
+    {
+        c3f* aov = malloc((size_t)cam.image_width * cam.image_height * sizeof(c3f));
+        if (!aov) exit(1);
 
-    save_as_ppm("render.ppm", cam.image_width, cam.image_height, cam.framebuffer);
+        for (int i = 0; i < CAMERA_AOV_COUNT; ++i)
+        {
+            char filename[260];
+            sprintf_s(filename, sizeof(filename), "render.%s.pfm", aov_names[i]);
+            camera_resolve_aov(&cam, i, aov);
+            if (!hdr_save_pfm(filename, cam.image_width, cam.image_height, aov))
+            {
+                fprintf_s(stderr, "Saving PFM file... FAIL\n");
+            }
+        }
+        free(aov);
+    }
 
+    free(previous);
     camera_delete(&cam);
+    geo_stream_close(&stream);
+    texture_delete(sphere_texture);
+    texture_cache_delete();
     return 0;
 }
 
@@ -175,7 +516,7 @@ void save_as_ppm(
     const char* filename,
     int image_width,
     int image_height,
-    c3f* framebuffer)
+    unsigned char* pixels)
 {
     fprintf_s(stderr, "\rSaving PPM file... INIT");
     FILE* file = NULL;
@@ -194,11 +535,182 @@ void save_as_ppm(
         fprintf_s(stderr, "\rSaving PPM file... %3d%%", (row * 100) / image_height);
         for (int col = 0; col < image_width; ++col)
         {
-            const v3f sc = v3f_mul(framebuffer[row * image_width + col], 255.999f);
-            fprintf_s(file, "%d %d %d\n", (int)sc.x, (int)sc.y, (int)sc.z);
+            const unsigned char* px = &pixels[(row * image_width + col) * 3];
+            fprintf_s(file, "%d %d %d\n", px[0], px[1], px[2]);
         }
     }
     fclose(file);
     fprintf_s(stderr, "\rSaving PPM file... DONE\n");
 }
 
+void save_tonemapped(
+    const char* filename,
+    int image_width,
+    int image_height,
+    c3f* hdr,
+    tonemap_settings* settings)
+{
+    const size_t pixels_count = (size_t)image_width * image_height;
+    unsigned char* pixels = malloc(pixels_count * 3);
+    if (!pixels) exit(1);
+
+    const f64 start = telemetry_now();
+    tonemap_apply(settings, hdr, pixels_count, pixels);
+    fprintf_s(stderr, "Tone mapping... DONE | %.2fms\n", (telemetry_now() - start) * 1e3);
+
+    save_as_ppm(filename, image_width, image_height, pixels);
+    free(pixels);
+}
+
+bool verify_determinism(camera* cam, hittable_array_list* world)
+{
+    const size_t bytes = (size_t)cam->image_width * cam->image_height * sizeof(c3f);
+    c3f* reference = malloc(bytes);
+    if (!reference) exit(1);
+
+    // more workers than cpus hand the tiles to yet other threads
+    const int workers[] = { 1, cam->topology.cpus_count, cam->topology.cpus_count * 4 };
+    bool identical = true;
+    for (int i = 0; i < (int)(sizeof(workers) / sizeof(workers[0])); ++i)
+    {
+        cam->mt_render = workers[i] > 1;
+        cam->th_count = workers[i];
+        camera_render(cam, world);
+
+        if (i == 0)
+        {
+            memcpy(reference, cam->framebuffer, bytes);
+            continue;
+        }
+
+        const bool match = memcmp(reference, cam->framebuffer, bytes) == 0;
+        fprintf_s(stderr, "Determinism check... %s | 1 and %d workers\n", match ? "DONE" : "FAIL", workers[i]);
+        identical = identical && match;
+    }
+
+    free(reference);
+    return identical;
+}
+
+material random_sphere_material(f32 choose_mat)
+{
+    if (choose_mat < 0.8f)
+    {
+        return (material){
+            .type = EMaterialType_LAMBERTIAN,
+            .lambertian = {
+                .albedo = v3f_mul_comp(
+                    (v3f){rand01(), rand01(), rand01()},
+                    (v3f){rand01(), rand01(), rand01()})
+            }
+        };
+    }
+    else if (choose_mat < 0.95f)
+    {
+        return (material){
+            .type = EMaterialType_METAL,
+            .metal = {
+                .albedo = (v3f){
+                    .r = rand_range(0.5f, 1.f),
+                    .g = rand_range(0.5f, 1.f),
+                    .b = rand_range(0.5f, 1.f)
+                },
+                .fuzz = rand_range(0.f, 0.5f)
+            }
+        };
+    }
+
+    return (material){
+        .type = EMaterialType_DIELECTRIC,
+        .dielectric = { .ir = 1.5f }
+    };
+}
+
+bool write_sphere_field(const char* path, long long count)
+{
+    // one sphere per unit square like the default scene, the grid grows around the origin
+    const int side = (int)ceil(sqrt((f64)max(count, 1)));
+    const f32 half = side * 0.5f;
+    const aabb bounds = {
+        .lo = {.x = -half, .y = 0.f, .z = -half},
+        .hi = {.x = half, .y = 2.f, .z = half}
+    };
+
+    // about 64k spheres per chunk
+    const int cells_per_axis = (int)ceil(sqrt(count / 65536.0));
+    const int cells[3] = { cells_per_axis, 1, cells_per_axis };
+
+    geo_writer writer;
+    if (!geo_writer_begin(&writer, path, bounds, cells))
+    {
+        fprintf_s(stderr, "Writing geometry stream... FAIL | %s\n", path);
+        return false;
+    }
+
+    const f32 ground = max(1000.f, half + 1.f);
+    hittable obj = {
+        .type = EHittableType_QUAD,
+        .q = quad_create(
+            (p3f){.x = -ground, .y = 0.f, .z = -ground},
+            (v3f){.x = 0.f, .y = 0.f, .z = 2.f * ground},
+            (v3f){.x = 2.f * ground, .y = 0.f, .z = 0.f},
+            (material){
+                .type = EMaterialType_LAMBERTIAN,
+                .lambertian = {.albedo = {.r = 0.5f, .g = 0.5f, .b = 0.5f}}
+            })
+    };
+    geo_writer_add(&writer, &obj);
+
+    const sphere big_spheres[] = {
+        { .center = {.x = 0.f, .y = 1.f, .z = 0.f}, .radius = 1.f,
+          .mat = {.type = EMaterialType_DIELECTRIC, .dielectric = {.ir = 1.5f}} },
+        { .center = {.x = -4.f, .y = 1.f, .z = 0.f}, .radius = 1.f,
+          .mat = {.type = EMaterialType_LAMBERTIAN, .lambertian = {.albedo = {.r = 0.4f, .g = 0.2f, .b = 0.1f}}} },
+        { .center = {.x = 4.f, .y = 1.f, .z = 0.f}, .radius = 1.f,
+          .mat = {.type = EMaterialType_METAL, .metal = {.albedo = {.r = 0.7f, .g = 0.6f, .b = 0.5f}, .fuzz = 0.f}} }
+    };
+    for (int i = 0; i < (int)(sizeof(big_spheres) / sizeof(big_spheres[0])); ++i)
+    {
+        obj = (hittable){ .type = EHittableType_SPHERE, .s = big_spheres[i] };
+        geo_writer_add(&writer, &obj);
+    }
+
+    long long written = 0;
+    for (int a = 0; a < side && written < count; ++a)
+    {
+        if (a % 64 == 0) fprintf_s(stderr, "\rWriting geometry stream... %3d%%", (int)(written * 100 / count));
+        for (int b = 0; b < side && written < count; ++b)
+        {
+            const f32 choose_mat = rand01();
+            const p3f center = {
+                .x = -half + a + 0.9f * rand01(),
+                .y = 0.2f,
+                .z = -half + b + 0.9f * rand01()
+            };
+
+            // keep clear of the big spheres
+            bool clear = true;
+            for (int i = 0; i < (int)(sizeof(big_spheres) / sizeof(big_spheres[0])); ++i)
+            {
+                const p3f base = { .x = big_spheres[i].center.x, .y = 0.2f, .z = big_spheres[i].center.z };
+                clear = clear && v3f_length(v3f_sub(center, base)) > 1.2f;
+            }
+            if (!clear) continue;
+
+            obj = (hittable){
+                .type = EHittableType_SPHERE,
+                .s = {
+                    .center = center,
+                    .center1 = center,
+                    .radius = 0.2f,
+                    .mat = random_sphere_material(choose_mat)
+                }
+            };
+            geo_writer_add(&writer, &obj);
+            ++written;
+        }
+    }
+    fprintf_s(stderr, "\r");
+
+    return geo_writer_end(&writer);
+}
@@ -4,53 +4,72 @@
 #include "vec3f.h"
 
 // Utils
-static f32 reflectance(f32 cosine, f32 ref_idx);
+#define DIFFUSE_CONE_SPREAD 1.f
+
+static f32  reflectance(f32 cosine, f32 ref_idx);
+static void scattered_init(ray* r, hit_record* rec, ray* scattered, v3f dir, f32 extra_spread);
+static c3f  textured(c3f value, texture* tex, ray* r, hit_record* rec);
 
 
 bool material_scatter(material* mat, ray* r, hit_record* rec, c3f* attenuation, ray* scattered)
 {
     switch (mat->type)
     {
-    case EMaterialType_LAMBERTIAN:
-    {
-        v3f scatter_dir = v3f_add(rec->normal, v3f_random_unit_vector());
-        if (v3f_near_zero(scatter_dir)) scatter_dir = rec->normal;
-        scattered->origin = rec->p;
-        scattered->dir = scatter_dir;
-        *attenuation = mat->lambertian.albedo;
-        return true;
-    }
-    case EMaterialType_METAL:
-    {
-        v3f reflected = v3f_reflect(v3f_unit(r->dir), rec->normal);
-        scattered->origin = rec->p;
-        scattered->dir = v3f_add(reflected, v3f_mul(v3f_random_unit_vector(), mat->metal.fuzz));
-        *attenuation = mat->metal.albedo;
-        return v3f_dot(scattered->dir, rec->normal) > 0.f;
-    }
-    case EMaterialType_DIELECTRIC:
-    {
-        *attenuation = (c3f){ .r = 1.0f, .g = 1.0f, .b = 1.0f };
-        f32 refraction_ratio = rec->front_face
-            ? (1.0f / mat->dielectric.ir)
-            : mat->dielectric.ir;
-
-        v3f unit_direction = v3f_unit(r->dir);
-        f32 cos_theta = fminf(v3f_dot(v3f_opposite(unit_direction), rec->normal), 1.0f);
-        f32 sin_theta = sqrtf(1.0f - cos_theta * cos_theta);
-        bool cannot_refract = refraction_ratio * sin_theta > 1.0f;
-
-        scattered->origin = rec->p;
-        scattered->dir = cannot_refract || reflectance(cos_theta, refraction_ratio) > rand01()
-            ? v3f_reflect(unit_direction, rec->normal)
-            : v3f_refract(unit_direction, rec->normal, refraction_ratio);
-
-        return true;
-    }
+#define X_MATERIAL_SCATTER_CASE(NAME, member) \
+    case EMaterialType_##NAME: return material_scatter_##member(mat, r, rec, attenuation, scattered);
+    MATERIAL_TYPES(X_MATERIAL_SCATTER_CASE)
+#undef X_MATERIAL_SCATTER_CASE
     default: return false;
     }
 }
 
+bool material_scatter_lambertian(material* mat, ray* r, hit_record* rec, c3f* attenuation, ray* scattered)
+{
+    v3f scatter_dir = v3f_add(rec->normal, v3f_random_unit_vector());
+    if (v3f_near_zero(scatter_dir)) scatter_dir = rec->normal;
+    scattered_init(r, rec, scattered, scatter_dir, DIFFUSE_CONE_SPREAD);
+    *attenuation = textured(mat->lambertian.albedo, mat->lambertian.albedo_tex, r, rec);
+    return true;
+}
+
+bool material_scatter_metal(material* mat, ray* r, hit_record* rec, c3f* attenuation, ray* scattered)
+{
+    const f32 fuzz = mat->metal.roughness_tex
+        ? mat->metal.fuzz * textured((c3f) { .r = 1.f, .g = 1.f, .b = 1.f }, mat->metal.roughness_tex, r, rec).r
+        : mat->metal.fuzz;
+    v3f reflected = v3f_reflect(v3f_unit(r->dir), rec->normal);
+    scattered_init(r, rec, scattered, v3f_add(reflected, v3f_mul(v3f_random_unit_vector(), fuzz)), fuzz);
+    *attenuation = textured(mat->metal.albedo, mat->metal.albedo_tex, r, rec);
+    return v3f_dot(scattered->dir, rec->normal) > 0.f;
+}
+
+bool material_scatter_dielectric(material* mat, ray* r, hit_record* rec, c3f* attenuation, ray* scattered)
+{
+    *attenuation = (c3f){ .r = 1.0f, .g = 1.0f, .b = 1.0f };
+    f32 refraction_ratio = rec->front_face
+        ? (1.0f / mat->dielectric.ir)
+        : mat->dielectric.ir;
+
+    v3f unit_direction = v3f_unit(r->dir);
+    f32 cos_theta = fminf(v3f_dot(v3f_opposite(unit_direction), rec->normal), 1.0f);
+    f32 sin_theta = sqrtf(1.0f - cos_theta * cos_theta);
+    bool cannot_refract = refraction_ratio * sin_theta > 1.0f;
+
+    const v3f dir = cannot_refract || reflectance(cos_theta, refraction_ratio) > rand01()
+        ? v3f_reflect(unit_direction, rec->normal)
+        : v3f_refract(unit_direction, rec->normal, refraction_ratio);
+    scattered_init(r, rec, scattered, dir, 0.f);
+
+    return true;
+}
+
+bool material_scatter_isotropic(material* mat, ray* r, hit_record* rec, c3f* attenuation, ray* scattered)
+{
+    scattered_init(r, rec, scattered, v3f_random_unit_vector(), DIFFUSE_CONE_SPREAD);
+    *attenuation = mat->isotropic.albedo;
+    return true;
+}
+
 f32 reflectance(f32 cosine, f32 ref_idx) {
     // Use Schlick's approximation for reflectance.
     f32 r0 = (1.f - ref_idx) / (1.f + ref_idx);
@@ -58,3 +77,23 @@ f32 reflectance(f32 cosine, f32 ref_idx) {
     return r0 + (1.f - r0) * powf((1.f - cosine), 5.f);
 }
 
+void scattered_init(ray* r, hit_record* rec, ray* scattered, v3f dir, f32 extra_spread)
+{
+    // the side of the surface the origin is pushed to follows dir
+    scattered->origin = ray_spawn_origin(rec, dir);
+    scattered->dir = dir;
+    scattered->time = r->time;
+
+    // rough heuristic, glossy and diffuse lobes widen the cone by their spread
+    scattered->cone_width = ray_cone_width_at(r, rec->t);
+    scattered->cone_spread = r->cone_spread + extra_spread;
+}
+
+c3f textured(c3f value, texture* tex, ray* r, hit_record* rec)
+{
+    if (!tex) return value;
+    hit_record_surface_uv(rec, r);
+    return v3f_mul_comp(value, texture_sample(tex, rec->u, rec->v, rec->footprint));
+}
+
+#undef DIFFUSE_CONE_SPREAD
@@ -2,15 +2,26 @@
 
 #include "defs.h"
 #include "vec3f.h"
+#include "texture.h"
 
 typedef enum EMaterialType EMaterialType;
 typedef struct material material;
 
+// X(NAME, member) for every material. Adding an entry generates the enum value and
+// the material_scatter dispatch, the material needs a material_scatter_<member> routine
+// and a hash_<member> routine in rendercache.c.
+#define MATERIAL_TYPES(X) \
+    X(LAMBERTIAN, lambertian) \
+    X(METAL, metal) \
+    X(DIELECTRIC, dielectric) \
+    X(ISOTROPIC, isotropic)
+
 enum EMaterialType
 {
-    EMaterialType_LAMBERTIAN,
-    EMaterialType_METAL,
-    EMaterialType_DIELECTRIC
+#define X_MATERIAL_ENUM(NAME, member) EMaterialType_##NAME,
+    MATERIAL_TYPES(X_MATERIAL_ENUM)
+#undef X_MATERIAL_ENUM
+    EMaterialType_COUNT
 };
 
 struct material
@@ -22,18 +33,27 @@ struct material
         struct lambertian_params
         {
             c3f albedo;
+            texture* albedo_tex; // optional, modulates albedo
         } lambertian;
 
         struct metal_params
         {
             c3f albedo;
             f32 fuzz;
+            texture* albedo_tex;    // optional, modulates albedo
+            texture* roughness_tex; // optional, red channel modulates fuzz
         } metal;
 
         struct dielectric_params
         {
             f32 ir;
         } dielectric;
+
+        // phase function of participating media, scatters uniformly over the sphere
+        struct isotropic_params
+        {
+            c3f albedo;
+        } isotropic;
     };
 };
 
@@ -44,3 +64,14 @@ bool material_scatter(
     struct hit_record* rec,
     c3f* attenuation,
     struct ray* scattered);
+
+// Per material scatter routines, see MATERIAL_TYPES
+#define X_MATERIAL_SCATTER_DECL(NAME, member) \
+    bool material_scatter_##member( \
+        material* mat, \
+        struct ray* r, \
+        struct hit_record* rec, \
+        c3f* attenuation, \
+        struct ray* scattered);
+MATERIAL_TYPES(X_MATERIAL_SCATTER_DECL)
+#undef X_MATERIAL_SCATTER_DECL
@@ -0,0 +1,225 @@
+#include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+#include "preview.h"
+#include "hittable.h"
+#include "telemetry.h"
+
+#define WIN32_LEAN_AND_MEAN
+#include "windows.h"
+#include "process.h"
+
+
+// Utils
+#define MAX_PASS_SAMPLES 64
+
+static void preview_read_commands(void* args);
+static void preview_publish(preview* p);
+
+
+void preview_initialize(preview* p)
+{
+    const int width = p->cam->image_width;
+    const int height = p->cam->image_height;
+    const size_t pixels_size = (size_t)width * height * 3;
+
+    p->mapping = NULL;
+    p->shared = NULL;
+    p->pixels = NULL;
+    p->view_dirty = 0;
+    p->quit = 0;
+    p->input_closed = 0;
+    p->cam->quiet_passes = true;
+
+    if (p->shared_name)
+    {
+        const size_t size = sizeof(preview_shared_header) + pixels_size;
+        HANDLE mapping = CreateFileMappingA(
+            INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE,
+            (DWORD)((unsigned long long)size >> 32), (DWORD)size,
+            p->shared_name);
+        void* view = mapping ? MapViewOfFile(mapping, FILE_MAP_ALL_ACCESS, 0, 0, size) : NULL;
+
+        if (view)
+        {
+            p->mapping = mapping;
+            p->shared = view;
+            p->shared->magic = PREVIEW_SHARED_MAGIC;
+            p->shared->width = width;
+            p->shared->height = height;
+            p->shared->samples = 0;
+            p->shared->sequence = 0;
+            p->pixels = (unsigned char*)(p->shared + 1);
+        }
+        else
+        {
+            if (mapping) CloseHandle(mapping);
+            fprintf_s(stderr, "Preview shared memory '%s'... FAIL\n", p->shared_name);
+        }
+    }
+
+    if (!p->pixels)
+    {
+        p->pixels = malloc(pixels_size);
+        if (!p->pixels) exit(1);
+    }
+
+    p->lock = malloc(sizeof(CRITICAL_SECTION));
+    if (!p->lock) exit(1);
+    InitializeCriticalSection(p->lock);
+}
+
+void preview_delete(preview* p)
+{
+    if (p->shared)
+    {
+        UnmapViewOfFile(p->shared);
+        CloseHandle(p->mapping);
+    }
+    else
+    {
+        free(p->pixels);
+    }
+    DeleteCriticalSection(p->lock);
+    free(p->lock);
+
+    p->mapping = NULL;
+    p->shared = NULL;
+    p->pixels = NULL;
+    p->lock = NULL;
+}
+
+void preview_run(preview* p)
+{
+    camera* cam = p->cam;
+    int pass_samples = 1;
+
+    _beginthread(preview_read_commands, 0, p);
+    camera_reset(cam);
+
+    while (!p->quit)
+    {
+        if (p->view_dirty)
+        {
+            // the reset clears the cancel, under the lock it can only be the one of the
+            // view taken here, a later set_view cancels again after it
+            EnterCriticalSection(p->lock);
+            cam->lookfrom = p->pending_lookfrom;
+            cam->lookat = p->pending_lookat;
+            InterlockedExchange(&p->view_dirty, 0);
+            camera_reset(cam);
+            LeaveCriticalSection(p->lock);
+
+            camera_update_view(cam);
+            pass_samples = 1;
+        }
+
+        if (cam->accum_samples >= cam->samples_per_px)
+        {
+            if (p->input_closed) break;
+            Sleep(10);
+            continue;
+        }
+
+        const int samples = min(pass_samples, cam->samples_per_px - cam->accum_samples);
+        const f64 start = telemetry_now();
+
+        // cancelled passes leave partial sums behind, the view change resets them
+        if (!camera_render_pass(cam, p->world, samples))
+        {
+            // the cancel may be seen before the view is, wait for it instead of spinning passes
+            while (!p->view_dirty && !p->quit) Sleep(1);
+            continue;
+        }
+
+        const f64 elapsed = telemetry_now() - start;
+        preview_publish(p);
+
+        // size the next pass to fit into the wall-clock budget
+        const f64 sample_time = elapsed / samples;
+        const f64 budget = p->pass_budget_ms / 1000.0;
+        pass_samples = sample_time > 0.0
+            ? (int)clamp((f32)(budget / sample_time), 1.f, (f32)MAX_PASS_SAMPLES)
+            : MAX_PASS_SAMPLES;
+    }
+}
+
+void preview_set_view(preview* p, p3f lookfrom, p3f lookat)
+{
+    // flag and cancel under the lock, so a render loop taking the view resets before or after both
+    EnterCriticalSection(p->lock);
+    p->pending_lookfrom = lookfrom;
+    p->pending_lookat = lookat;
+    InterlockedExchange(&p->view_dirty, 1);
+    camera_cancel(p->cam);
+    LeaveCriticalSection(p->lock);
+}
+
+void preview_quit(preview* p)
+{
+    InterlockedExchange(&p->quit, 1);
+    camera_cancel(p->cam);
+}
+
+void preview_read_commands(void* args)
+{
+    preview* p = args;
+    char line[256];
+
+    // view <from x y z> <at x y z>
+    // quit
+    while (fgets(line, sizeof(line), stdin))
+    {
+        p3f from, at;
+        if (sscanf_s(line, "view %f %f %f %f %f %f", &from.x, &from.y, &from.z, &at.x, &at.y, &at.z) == 6)
+        {
+            preview_set_view(p, from, at);
+        }
+        else if (strncmp(line, "quit", 4) == 0)
+        {
+            preview_quit(p);
+            return;
+        }
+    }
+
+    // no more view changes can arrive, finish refining and stop
+    InterlockedExchange(&p->input_closed, 1);
+}
+
+void preview_publish(preview* p)
+{
+    camera* cam = p->cam;
+    const int pixels_count = cam->image_width * cam->image_height;
+
+    if (p->shared) InterlockedIncrement(&p->shared->sequence);
+
+    tonemap_apply(&p->tonemap, cam->framebuffer, pixels_count, p->pixels);
+
+    if (p->shared)
+    {
+        p->shared->samples = cam->accum_samples;
+        InterlockedIncrement(&p->shared->sequence);
+    }
+
+    if (p->output_file)
+    {
+        // write aside and swap so a viewer never reads a half written file
+        char tmp_name[260];
+        sprintf_s(tmp_name, sizeof(tmp_name), "%s.tmp", p->output_file);
+
+        FILE* file = NULL;
+        fopen_s(&file, tmp_name, "wb");
+        if (file)
+        {
+            fprintf_s(file, "P6\n%d %d\n255\n", cam->image_width, cam->image_height);
+            fwrite(p->pixels, 3, pixels_count, file);
+            fclose(file);
+            MoveFileExA(tmp_name, p->output_file, MOVEFILE_REPLACE_EXISTING);
+        }
+    }
+
+    fprintf_s(stderr, "Preview pass... %d spp\n", cam->accum_samples);
+}
+
+#undef WIN32_LEAN_AND_MEAN
+#undef MAX_PASS_SAMPLES
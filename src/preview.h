@@ -0,0 +1,49 @@
+#pragma once
+
+#include "defs.h"
+#include "vec3f.h"
+#include "camera.h"
+#include "tonemap.h"
+
+#define PREVIEW_SHARED_MAGIC 0x57455250 // 'PREW'
+
+typedef struct preview preview;
+typedef struct preview_shared_header preview_shared_header;
+
+// Layout of the shared memory segment, followed by width * height RGB8 pixels.
+// Readers copy the pixels while sequence is even and unchanged before and after.
+struct preview_shared_header
+{
+    unsigned int magic;
+    int width;
+    int height;
+    int samples;
+    volatile long sequence;
+};
+
+struct preview
+{
+    camera* cam;
+    struct hittable_array_list* world;
+    int pass_budget_ms;
+    const char* shared_name;  // NULL disables the shared memory framebuffer
+    const char* output_file;  // NULL disables writing a PPM after each pass
+    tonemap_settings tonemap;
+
+    // internals
+    void* mapping;
+    preview_shared_header* shared;
+    unsigned char* pixels;
+    void* lock;
+    p3f pending_lookfrom;
+    p3f pending_lookat;
+    volatile long view_dirty;
+    volatile long quit;
+    volatile long input_closed;
+};
+
+void preview_initialize(preview* p);
+void preview_delete(preview* p);
+void preview_run(preview* p);
+void preview_set_view(preview* p, p3f lookfrom, p3f lookat);
+void preview_quit(preview* p);
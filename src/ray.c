@@ -1,54 +1,400 @@
 #include "math.h"
 #include "ray.h"
+#include "bvh.h"
+#include "geostream.h"
 
 // Utils
+typedef struct vec3g
+{
+    fgeo x;
+    fgeo y;
+    fgeo z;
+} v3g;
+
 void set_face_normal(hit_record* rec, ray* r, v3f outward_normal);
+static v3g  v3g_from(v3f v);
+static v3g  v3g_sub(v3g v, v3g u);
+static v3g  v3g_mul(v3g v, fgeo s);
+static fgeo v3g_dot(v3g v, v3g u);
+static v3f  v3f_abs(v3f v);
+static bool slab_range(aabb* bounds, ray* r, f32* t_near, f32* t_far, int* near_axis, int* far_axis);
 
 const interval interval_universe = { .v_min = -INFINITY, .v_max = INFINITY };
 const interval interval_empty = { .v_min = INFINITY, .v_max = -INFINITY };
+const interval interval_ray = { .v_min = 0.f, .v_max = INFINITY };
 
 v3f ray_at(ray* r, f32 t)
 {
     return v3f_add(r->origin, v3f_mul(r->dir, t));
 }
 
+f32 ray_cone_width_at(ray* r, f32 t)
+{
+    return r->cone_width + r->cone_spread * t * v3f_length(r->dir);
+}
+
 bool ray_hit(ray* r, interval t_interval, hittable* obj, hit_record* rec)
 {
     switch (obj->type)
     {
-    case EHittableType_SPHERE:
+#define X_RAY_HIT_CASE(NAME, type, member) \
+    case EHittableType_##NAME: return ray_hit_##type(r, t_interval, &obj->member, rec);
+    HITTABLE_TYPES(X_RAY_HIT_CASE)
+#undef X_RAY_HIT_CASE
+    default: return false;
+    }
+}
+
+// The kernels live next to the routines they call so those get inlined
+#define X_RAY_HIT_ALL(NAME, type, member) \
+bool ray_hit_all_##type(ray* r, interval t_interval, hittable* objs, size_t count, hit_record* rec) \
+{ \
+    bool hit_anything = false; \
+    for (size_t i = 0; i < count; ++i) \
+    { \
+        if (ray_hit_##type(r, t_interval, &objs[i].member, rec)) \
+        { \
+            hit_anything = true; \
+            t_interval.v_max = rec->t; \
+        } \
+    } \
+    return hit_anything; \
+}
+HITTABLE_TYPES(X_RAY_HIT_ALL)
+#undef X_RAY_HIT_ALL
+
+bool ray_hit_sphere(ray* r, interval t_interval, sphere* s, hit_record* rec)
+{
+    const p3f center = sphere_center(s, r->time);
+    const v3g oc = v3g_sub(v3g_from(r->origin), v3g_from(center));
+    const v3g dir = v3g_from(r->dir);
+    const fgeo radius = s->radius;
+    const fgeo a = v3g_dot(dir, dir);
+    const fgeo half_b = v3g_dot(oc, dir);
+    const fgeo c = v3g_dot(oc, oc) - radius * radius;
+
+    // distance of the center to the ray line instead of half_b^2 - a*c, which
+    // cancels catastrophically for rays far away from a small sphere
+    const v3g l = v3g_sub(oc, v3g_mul(dir, half_b / a));
+    const fgeo discriminant = a * (radius * radius - v3g_dot(l, l));
+
+    if (discriminant < 0) return false;
+
+    // q has the sign of -half_b, so neither root subtracts values of similar size
+    const fgeo q = -(half_b + fgeo_copysign(fgeo_sqrt(discriminant), half_b));
+    if (q == 0) return false;
+
+    const f32 t0 = (f32)(c / q);
+    const f32 t1 = (f32)(q / a);
+    f32 root = fminf(t0, t1);
+    if (!interval_surrounds(t_interval, root))
     {
-        sphere* s = &obj->s;
-        const v3f oc = v3f_sub(r->origin, s->center);
-        const f32 a = v3f_length_squared(r->dir);
-        const f32 half_b = v3f_dot(oc, r->dir);
-        const f32 c = v3f_length_squared(oc) - s->radius * s->radius;
-        const f32 discriminant = half_b * half_b - a * c;
+        root = fmaxf(t0, t1);
+        if (!interval_surrounds(t_interval, root)) return false;
+    }
 
-        if (discriminant < 0) return false;
+    // project the hit back onto the surface, p is then only off by rounding
+    const v3g pc = v3g_sub(v3g_from(ray_at(r, root)), v3g_from(center));
+    const v3g on_surface = v3g_mul(pc, radius / fgeo_sqrt(v3g_dot(pc, pc)));
+    const v3f offset = { .x = (f32)on_surface.x, .y = (f32)on_surface.y, .z = (f32)on_surface.z };
 
-        const f32 sqrtd = sqrtf(discriminant);
-        f32 root = (-half_b - sqrtd) / a;
-        if (!interval_surrounds(t_interval, root))
-        {
-            root = (-half_b + sqrtd) / a;
-            if (!interval_surrounds(t_interval, root)) return false;
-        }
+    rec->p = v3f_add(center, offset);
+    rec->p_error = v3f_mul(v3f_add(v3f_abs(center), v3f_abs(offset)), error_gamma(5));
+    rec->t = root;
+    const v3f outward_normal = v3f_div(offset, s->radius);
+    set_face_normal(rec, r, outward_normal);
+    rec->mat = &s->mat;
+    rec->obj_type = EHittableType_SPHERE;
+    rec->obj = s;
+    return true;
+}
+
+bool ray_hit_quad(ray* r, interval t_interval, quad* q, hit_record* rec)
+{
+    // one plane test, the parameters then reject points outside the parallelogram
+    const fgeo denom = v3g_dot(v3g_from(q->normal), v3g_from(r->dir));
+    if (fabs((f64)denom) < 1e-8) return false;
+
+    const f32 t = (f32)((q->d - v3g_dot(v3g_from(q->normal), v3g_from(r->origin))) / denom);
+    if (!interval_surrounds(t_interval, t)) return false;
+
+    const v3f planar = v3f_sub(ray_at(r, t), q->q);
+    const f32 alpha = v3f_dot(q->w, v3f_cross(planar, q->v));
+    const f32 beta = v3f_dot(q->w, v3f_cross(q->u, planar));
+    if (alpha < 0.f || alpha > 1.f || beta < 0.f || beta > 1.f) return false;
+
+    // rebuild p from the parameters so it lies in the plane up to rounding
+    const v3f au = v3f_mul(q->u, alpha);
+    const v3f bv = v3f_mul(q->v, beta);
+    rec->p = v3f_add(q->q, v3f_add(au, bv));
+    rec->p_error = v3f_mul(v3f_add(v3f_abs(q->q), v3f_add(v3f_abs(au), v3f_abs(bv))), error_gamma(7));
+    rec->t = t;
+    rec->u = alpha;
+    rec->v = beta;
+    set_face_normal(rec, r, q->normal);
+    rec->mat = &q->mat;
+    rec->obj_type = EHittableType_QUAD;
+    rec->obj = q;
+    return true;
+}
+
+bool ray_hit_box(ray* r, interval t_interval, box* b, hit_record* rec)
+{
+    f32 t_near, t_far;
+    int near_axis, far_axis;
+    if (!slab_range(&b->bounds, r, &t_near, &t_far, &near_axis, &far_axis)) return false;
 
-        rec->p = ray_at(r, root);
-        rec->t = root;
-        const v3f outward_normal = v3f_div(v3f_sub(rec->p, s->center), s->radius);
-        set_face_normal(rec, r, outward_normal);
-        rec->mat = &s->mat;
-        return true;
+    // rays starting inside leave through the far face
+    f32 t;
+    int axis;
+    bool entering;
+    if (interval_surrounds(t_interval, t_near))
+    {
+        t = t_near;
+        axis = near_axis;
+        entering = true;
     }
-    default: return false;
+    else if (interval_surrounds(t_interval, t_far))
+    {
+        t = t_far;
+        axis = far_axis;
+        entering = false;
+    }
+    else
+    {
+        return false;
+    }
+
+    const bool positive = r->dir.e[axis] > 0.f;
+    rec->p = ray_at(r, t);
+    rec->p.e[axis] = (positive == entering) ? b->bounds.lo.e[axis] : b->bounds.hi.e[axis];
+    rec->p_error = v3f_mul(v3f_abs(rec->p), error_gamma(3));
+    rec->t = t;
+
+    v3f outward_normal = { .x = 0.f, .y = 0.f, .z = 0.f };
+    outward_normal.e[axis] = (positive == entering) ? -1.f : 1.f;
+    set_face_normal(rec, r, outward_normal);
+    rec->mat = &b->mat;
+    rec->obj_type = EHittableType_BOX;
+    rec->obj = b;
+    return true;
+}
+
+bool ray_hit_medium(ray* r, interval t_interval, medium* m, hit_record* rec)
+{
+    f32 t_near, t_far;
+    int near_axis, far_axis;
+    if (!slab_range(&m->boundary, r, &t_near, &t_far, &near_axis, &far_axis)) return false;
+
+    t_near = fmaxf(t_near, t_interval.v_min);
+    t_far = fminf(t_far, t_interval.v_max);
+    if (t_near >= t_far) return false;
+
+    // free flight distance, rand01 may return 0 which never scatters
+    const f32 ray_length = v3f_length(r->dir);
+    const f32 hit_distance = -logf(rand01()) / m->density;
+    if (hit_distance >= (t_far - t_near) * ray_length) return false;
+
+    // rec may hold a closer hit, it is only written once the sample is accepted
+    const f32 t = t_near + hit_distance / ray_length;
+    if (!interval_surrounds(t_interval, t)) return false;
+
+    // no surface to step off from, scattered rays start at p
+    rec->t = t;
+    rec->p = ray_at(r, t);
+    rec->p_error = (v3f){ .x = 0.f, .y = 0.f, .z = 0.f };
+    rec->normal = (v3f){ .x = 1.f, .y = 0.f, .z = 0.f };
+    rec->front_face = true;
+    rec->mat = &m->mat;
+    rec->obj_type = EHittableType_MEDIUM;
+    rec->obj = m;
+    return true;
+}
+
+void hit_record_surface_uv(hit_record* rec, ray* r)
+{
+    switch (rec->obj_type)
+    {
+#define X_SURFACE_UV_CASE(NAME, type, member) \
+    case EHittableType_##NAME: type##_surface_uv(rec->obj, rec, r); break;
+    HITTABLE_TYPES(X_SURFACE_UV_CASE)
+#undef X_SURFACE_UV_CASE
+    default: break;
+    }
+}
+
+void sphere_surface_uv(sphere* s, hit_record* rec, ray* r)
+{
+    // u runs around the y axis from -x, v from the bottom pole, u spans 2 pi r
+    const v3f n = v3f_div(v3f_sub(rec->p, sphere_center(s, r->time)), s->radius);
+    const f32 theta = acosf(clamp(-n.y, -1.f, 1.f));
+    const f32 phi = atan2f(-n.z, n.x) + (f32)PI;
+    rec->u = phi / (2.f * (f32)PI);
+    rec->v = theta / (f32)PI;
+    rec->footprint = ray_cone_width_at(r, rec->t) / (2.f * (f32)PI * s->radius);
+}
+
+p3f ray_spawn_origin(hit_record* rec, v3f dir)
+{
+    const v3f n = v3f_abs(rec->normal);
+    const f32 d = n.x * rec->p_error.x + n.y * rec->p_error.y + n.z * rec->p_error.z;
+    v3f offset = v3f_mul(rec->normal, d);
+    if (v3f_dot(dir, rec->normal) < 0.f) offset = v3f_opposite(offset);
+
+    // round away from p, the offset must survive the addition
+    p3f origin = v3f_add(rec->p, offset);
+    for (int a = 0; a < 3; ++a)
+    {
+        if (offset.e[a] > 0.f) origin.e[a] = nextafterf(origin.e[a], INFINITY);
+        else if (offset.e[a] < 0.f) origin.e[a] = nextafterf(origin.e[a], -INFINITY);
     }
+    return origin;
+}
+
+void quad_surface_uv(quad* q, hit_record* rec, ray* r)
+{
+    // u and v are the plane parameters, already set by the hit
+    rec->footprint = ray_cone_width_at(r, rec->t) / sqrtf(fmaxf(v3f_length_squared(q->u), v3f_length_squared(q->v)));
+}
+
+void box_surface_uv(box* b, hit_record* rec, ray* r)
+{
+    // every face maps its two in-plane axes onto the unit square
+    const v3f n = v3f_abs(rec->normal);
+    const int axis = (n.x > n.y && n.x > n.z) ? 0 : (n.y > n.z ? 1 : 2);
+    const int a0 = (axis + 1) % 3;
+    const int a1 = (axis + 2) % 3;
+    const f32 e0 = b->bounds.hi.e[a0] - b->bounds.lo.e[a0];
+    const f32 e1 = b->bounds.hi.e[a1] - b->bounds.lo.e[a1];
+    rec->u = e0 > 0.f ? (rec->p.e[a0] - b->bounds.lo.e[a0]) / e0 : 0.f;
+    rec->v = e1 > 0.f ? (rec->p.e[a1] - b->bounds.lo.e[a1]) / e1 : 0.f;
+    rec->footprint = ray_cone_width_at(r, rec->t) / fmaxf(fmaxf(e0, e1), FLT_MIN);
 }
 
+void medium_surface_uv(medium* m, hit_record* rec, ray* r)
+{
+    // a volume has no surface to map
+    (void)m;
+    (void)r;
+    rec->u = 0.f;
+    rec->v = 0.f;
+    rec->footprint = 0.f;
+}
 
 void set_face_normal(hit_record* rec, ray* r, v3f outward_normal)
 {
     rec->front_face = v3f_dot(r->dir, outward_normal) < 0;
     rec->normal = rec->front_face ? outward_normal : v3f_opposite(outward_normal);
 }
+
+bool raytest(hittable_array_list* list, ray* r, interval t_interval, hit_record* rec)
+{
+    if (list->stream) return geo_stream_raytest(list->stream, r, t_interval, rec);
+    if (list->bvh_nodes_count > 0) return bvh_raytest(list, r, t_interval, rec);
+
+    bool hit_anything = false;
+
+    if (!list->bucketed)
+    {
+        hit_record tmp_rec;
+        f32 closest_t = t_interval.v_max;
+
+        for (int i = 0; i < (int)list->size; ++i)
+        {
+            hittable* obj = &list->data[i];
+            const interval new_interval = { .v_min = t_interval.v_min, .v_max = closest_t };
+            if (ray_hit(r, new_interval, obj, &tmp_rec))
+            {
+                hit_anything = true;
+                closest_t = tmp_rec.t;
+                *rec = tmp_rec;
+            }
+        }
+
+        return hit_anything;
+    }
+
+    // one branch-free kernel per bucket instead of a type switch per object
+#define X_RAYTEST_BUCKET(NAME, type, member) \
+    { \
+        const size_t first = list->type_offsets[EHittableType_##NAME]; \
+        const size_t count = list->type_offsets[EHittableType_##NAME + 1] - first; \
+        if (ray_hit_all_##type(r, t_interval, &list->data[first], count, rec)) \
+        { \
+            hit_anything = true; \
+            t_interval.v_max = rec->t; \
+        } \
+    }
+    HITTABLE_TYPES(X_RAYTEST_BUCKET)
+#undef X_RAYTEST_BUCKET
+
+    return hit_anything;
+}
+
+c3f ray_background(ray* r)
+{
+    const v3f unit_direction = v3f_unit(r->dir);
+    const f32 a = 0.5f * (unit_direction.y + 1.f);
+
+    const c3f c1 = v3f_mul((c3f) { .r = 1.f, .g = 1.f, .b = 1.f }, 1.f - a);
+    const c3f c2 = v3f_mul((c3f) { .r = 0.5f, .g = 0.7f, .b = 1.f }, a);
+    return v3f_add(c1, c2);
+}
+
+v3g v3g_from(v3f v)
+{
+    return (v3g) { .x = v.x, .y = v.y, .z = v.z };
+}
+
+v3g v3g_sub(v3g v, v3g u)
+{
+    return (v3g) { .x = v.x - u.x, .y = v.y - u.y, .z = v.z - u.z };
+}
+
+v3g v3g_mul(v3g v, fgeo s)
+{
+    return (v3g) { .x = v.x * s, .y = v.y * s, .z = v.z * s };
+}
+
+fgeo v3g_dot(v3g v, v3g u)
+{
+    return v.x * u.x + v.y * u.y + v.z * u.z;
+}
+
+v3f v3f_abs(v3f v)
+{
+    return (v3f) { .x = fabsf(v.x), .y = fabsf(v.y), .z = fabsf(v.z) };
+}
+
+bool slab_range(aabb* bounds, ray* r, f32* t_near, f32* t_far, int* near_axis, int* far_axis)
+{
+    *t_near = -INFINITY;
+    *t_far = INFINITY;
+    *near_axis = 0;
+    *far_axis = 0;
+
+    for (int a = 0; a < 3; ++a)
+    {
+        const f32 inv_dir = 1.f / r->dir.e[a];
+        f32 t0 = (bounds->lo.e[a] - r->origin.e[a]) * inv_dir;
+        f32 t1 = (bounds->hi.e[a] - r->origin.e[a]) * inv_dir;
+        if (inv_dir < 0.f)
+        {
+            const f32 t = t0;
+            t0 = t1;
+            t1 = t;
+        }
+        if (t0 > *t_near)
+        {
+            *t_near = t0;
+            *near_axis = a;
+        }
+        if (t1 < *t_far)
+        {
+            *t_far = t1;
+            *far_axis = a;
+        }
+    }
+
+    return *t_near <= *t_far;
+}
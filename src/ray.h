@@ -11,6 +11,11 @@ struct ray
 {
     p3f origin;
     v3f dir;
+    f32 time;
+
+    // ray cone, footprint width at the origin and its growth per unit distance
+    f32 cone_width;
+    f32 cone_spread;
 };
 
 struct interval
@@ -22,9 +27,30 @@ struct interval
 
 extern const interval interval_universe;
 extern const interval interval_empty;
+extern const interval interval_ray; // (0, inf), spawned origins are already off the surface
 
 v3f  ray_at(ray* r, f32 t);
+f32  ray_cone_width_at(ray* r, f32 t);
+
+// Origin for a ray leaving the hit in dir, pushed past the p_error box of the hit
+// point along the normal so the new ray cannot hit the same surface again.
+p3f  ray_spawn_origin(hit_record* rec, v3f dir);
+
+// Texture coordinates are only needed by textured materials, they fill u, v and
+// footprint of the closest hit on demand.
+void hit_record_surface_uv(hit_record* rec, ray* r);
 bool ray_hit(ray* r, interval t_interval, hittable* obj, hit_record* rec);
+bool raytest(hittable_array_list* list, ray* r, interval t_interval, hit_record* rec);
+c3f  ray_background(ray* r);
+
+// Per primitive intersection routines and their type-homogeneous kernels testing
+// a whole bucket of objects of that type, see HITTABLE_TYPES
+#define X_RAY_HIT_DECL(NAME, type, member) \
+    bool ray_hit_##type(ray* r, interval t_interval, type* obj, hit_record* rec); \
+    bool ray_hit_all_##type(ray* r, interval t_interval, hittable* objs, size_t count, hit_record* rec); \
+    void type##_surface_uv(type* obj, hit_record* rec, ray* r);
+HITTABLE_TYPES(X_RAY_HIT_DECL)
+#undef X_RAY_HIT_DECL
 
 inline bool interval_contains(interval i, f32 v) { return i.v_min <= v && v <= i.v_max; }
 inline bool interval_surrounds(interval i, f32 v) { return i.v_min < v && v < i.v_max; }
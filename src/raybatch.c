@@ -0,0 +1,456 @@
+#include "string.h"
+#include "math.h"
+#include "malloc.h"
+#include "raybatch.h"
+#include "material.h"
+#include "irradiance.h"
+#include "geostream.h"
+
+// Utils
+#define COHERENCE_GRID_BITS 4
+
+static size_t ray_batch_trace(
+    ray_batch* batch,
+    hittable_array_list* world,
+    size_t count,
+    int bounce,
+    bool deterministic,
+    const irradiance_cache* cache,
+    c3f* colors,
+    c3f* aovs);
+static void   path_contribute(ray_path* p, c3f radiance, c3f* colors, c3f* aovs);
+static void   ray_batch_intersect_queued(ray_batch* batch, geo_stream* stream, size_t count, int bounce, bool deterministic);
+static size_t ray_batch_shade(ray_batch* batch, size_t count, bool deterministic);
+static void   ray_batch_sort_by_coherence(ray_batch* batch, size_t count);
+static void   ray_batch_swap(ray_batch* batch);
+static unsigned short coherence_key(ray* r, p3f lo, v3f inv_extent);
+
+// Scatter kernels over a bucket of paths which hit the same material type,
+// survivors are compacted to out which may alias paths.
+#define X_SCATTER_ALL(NAME, member) \
+static size_t scatter_all_##member(ray_path* paths, size_t count, ray_path* out, bool deterministic) \
+{ \
+    size_t alive = 0; \
+    for (size_t i = 0; i < count; ++i) \
+    { \
+        ray_path* p = &paths[i]; \
+        if (deterministic) rng_thread = p->rng; \
+        ray scattered; \
+        c3f attenuation; \
+        if (material_scatter_##member(p->rec.mat, &p->r, &p->rec, &attenuation, &scattered)) \
+        { \
+            const c3f throughput = v3f_mul_comp(p->throughput, attenuation); \
+            const int pixel = p->pixel; \
+            const int aov = p->aov; \
+            out[alive].r = scattered; \
+            out[alive].throughput = throughput; \
+            out[alive].pixel = pixel; \
+            out[alive].aov = aov; \
+            out[alive].rng = rng_thread; \
+            ++alive; \
+        } \
+    } \
+    return alive; \
+}
+MATERIAL_TYPES(X_SCATTER_ALL)
+#undef X_SCATTER_ALL
+
+
+void ray_batch_init(ray_batch* batch, size_t capacity)
+{
+    batch->capacity = capacity;
+    batch->paths = malloc(capacity * sizeof(ray_path));
+    batch->sorted = malloc(capacity * sizeof(ray_path));
+    batch->keys = malloc(capacity * sizeof(unsigned short));
+    batch->sorted_keys = malloc(capacity * sizeof(unsigned short));
+    batch->queue = NULL;
+    batch->sorted_queue = NULL;
+    batch->queue_capacity = 0;
+    batch->chunk_offsets = NULL;
+    batch->wave_offsets = NULL;
+    batch->waves_capacity = 0;
+    batch->candidates = NULL;
+    batch->candidates_t = NULL;
+    batch->candidates_capacity = 0;
+    batch->hit_materials = NULL;
+    batch->hits = NULL;
+
+    if (!batch->paths || !batch->sorted || !batch->keys || !batch->sorted_keys) exit(1);
+}
+
+void ray_batch_delete(ray_batch* batch)
+{
+    free(batch->paths);
+    free(batch->sorted);
+    free(batch->keys);
+    free(batch->sorted_keys);
+    free(batch->queue);
+    free(batch->sorted_queue);
+    free(batch->chunk_offsets);
+    free(batch->wave_offsets);
+    free(batch->candidates);
+    free(batch->candidates_t);
+    free(batch->hit_materials);
+    free(batch->hits);
+    batch->queue_capacity = 0;
+    batch->candidates_capacity = 0;
+    batch->waves_capacity = 0;
+    batch->capacity = 0;
+}
+
+size_t ray_batch_bytes(size_t capacity, hittable_array_list* world)
+{
+    size_t bytes = capacity * (2 * sizeof(ray_path) + 2 * sizeof(unsigned short));
+    if (world->stream)
+    {
+        // a ray over the grid of chunks crosses about as many as the grid is wide
+        const size_t chunks_per_ray = (size_t)ceil(sqrt((f64)world->stream->chunks_count));
+        bytes += capacity * (sizeof(bool) + sizeof(material) + 2 * chunks_per_ray * sizeof(ray_queue_entry))
+            + (world->stream->chunks_count + 1) * sizeof(int)
+            + chunks_per_ray * (sizeof(int) + sizeof(f32));
+    }
+    return bytes;
+}
+
+long long ray_batch_render_tile(
+    ray_batch* batch,
+    camera* cam,
+    hittable_array_list* world,
+    pixel_rect rect,
+    int samples,
+    c3f* colors,
+    c3f* aovs)
+{
+    const long long pixels_count = (long long)rect.width * rect.height;
+    const long long paths_total = pixels_count * samples;
+    long long rays_traced = 0;
+
+    // paths are issued sample-major so every batch spans the whole tile
+    for (long long first = 0; first < paths_total; first += batch->capacity)
+    {
+        size_t count = (size_t)min(paths_total - first, (long long)batch->capacity);
+        for (size_t i = 0; i < count; ++i)
+        {
+            const int pixel = (int)((first + (long long)i) % pixels_count);
+            const int col = rect.x + pixel % rect.width;
+            const int row = rect.y + pixel / rect.width;
+
+            // the same numbers as the recursive path of this pixel sample, see rng.h
+            if (cam->deterministic)
+            {
+                const int sample = (int)((first + (long long)i) / pixels_count);
+                rng_begin_path((unsigned long long)row * cam->image_width + col, cam->accum_samples + sample);
+            }
+            batch->paths[i] = (ray_path){
+                .r = camera_get_ray(cam, col, row),
+                .throughput = { .r = 1.f, .g = 1.f, .b = 1.f },
+                .pixel = pixel,
+                .aov = -1,
+                .rng = rng_thread
+            };
+        }
+
+        // same depth semantics as the recursive ray_color, paths still alive after
+        // max_depth bounces contribute nothing
+        for (int depth = cam->max_depth; depth > 0 && count > 0; --depth)
+        {
+            rays_traced += count;
+            // like ray_color, only hits past the first bounce use the irradiance cache
+            const irradiance_cache* cache = depth < cam->max_depth ? cam->irradiance : NULL;
+            count = ray_batch_trace(
+                batch, world, count, cam->max_depth - depth, cam->deterministic, cache, colors, aovs);
+            count = ray_batch_shade(batch, count, cam->deterministic);
+            ray_batch_sort_by_coherence(batch, count);
+        }
+    }
+
+    return rays_traced;
+}
+
+size_t ray_batch_trace(
+    ray_batch* batch,
+    hittable_array_list* world,
+    size_t count,
+    int bounce,
+    bool deterministic,
+    const irradiance_cache* cache,
+    c3f* colors,
+    c3f* aovs)
+{
+    const interval t_interval = interval_ray;
+    size_t hits = 0;
+
+    // streamed scenes are intersected chunk by chunk up front, the bounce streams are begun there
+    if (world->stream) ray_batch_intersect_queued(batch, world->stream, count, bounce, deterministic);
+
+    for (size_t i = 0; i < count; ++i)
+    {
+        ray_path* p = &batch->paths[i];
+        if (deterministic)
+        {
+            rng_thread = p->rng;
+            if (!world->stream) rng_begin_bounce(bounce);
+        }
+
+        const bool hit = world->stream ? batch->hits[i] : raytest(world, &p->r, t_interval, &p->rec);
+        p->rng = rng_thread;
+        if (hit)
+        {
+            if (p->aov < 0) p->aov = p->rec.mat->type;
+
+            c3f radiance;
+            if (cache
+                && p->rec.mat->type == EMaterialType_LAMBERTIAN
+                && irradiance_cache_lookup(cache, p->rec.p, p->rec.normal, &radiance))
+            {
+                // the path ends here, the scatter only provides the albedo
+                ray scattered;
+                c3f albedo;
+                material_scatter(p->rec.mat, &p->r, &p->rec, &albedo, &scattered);
+                path_contribute(p, v3f_mul_comp(albedo, radiance), colors, aovs);
+                continue;
+            }
+
+            if (hits != i) batch->paths[hits] = *p;
+            ++hits;
+        }
+        else
+        {
+            path_contribute(p, ray_background(&p->r), colors, aovs);
+        }
+    }
+
+    return hits;
+}
+
+void ray_batch_intersect_queued(ray_batch* batch, geo_stream* stream, size_t count, int bounce, bool deterministic)
+{
+    if (!batch->hits)
+    {
+        batch->hits = malloc(batch->capacity * sizeof(bool));
+        batch->hit_materials = malloc(batch->capacity * sizeof(material));
+        batch->chunk_offsets = malloc((stream->chunks_count + 1) * sizeof(int));
+        if (!batch->hits || !batch->hit_materials || !batch->chunk_offsets) exit(1);
+    }
+
+    // every path waits at each chunk its ray crosses, nearest first
+    size_t queued = 0;
+    int waves_count = 0;
+    for (size_t i = 0; i < count; ++i)
+    {
+        ray_path* p = &batch->paths[i];
+        batch->hits[i] = false;
+        if (deterministic)
+        {
+            rng_thread = p->rng;
+            rng_begin_bounce(bounce);
+            p->rng = rng_thread;
+        }
+
+        const int n = geo_stream_chunks_hit(
+            stream, &p->r, interval_ray, &batch->candidates, &batch->candidates_t, &batch->candidates_capacity);
+        if (queued + n > batch->queue_capacity)
+        {
+            batch->queue_capacity = max(queued + n, 2 * batch->queue_capacity);
+            batch->queue = realloc(batch->queue, batch->queue_capacity * sizeof(ray_queue_entry));
+            batch->sorted_queue = realloc(batch->sorted_queue, batch->queue_capacity * sizeof(ray_queue_entry));
+            if (!batch->queue || !batch->sorted_queue) exit(1);
+        }
+        for (int k = 0; k < n; ++k)
+        {
+            batch->queue[queued++] = (ray_queue_entry){
+                .path = (int)i,
+                .chunk = batch->candidates[k],
+                .wave = k,
+                .t_enter = batch->candidates_t[k]
+            };
+        }
+        waves_count = max(waves_count, n);
+    }
+
+    if (waves_count + 1 > batch->waves_capacity)
+    {
+        batch->waves_capacity = max(waves_count + 1, 2 * batch->waves_capacity);
+        batch->wave_offsets = realloc(batch->wave_offsets, batch->waves_capacity * sizeof(int));
+        if (!batch->wave_offsets) exit(1);
+    }
+
+    // wave k holds the k-th nearest chunk of every path, so a chunk is only reached
+    // once the nearer ones were tested and is skipped when they already hid it
+    int* waves = batch->wave_offsets;
+    memset(waves, 0, (waves_count + 1) * sizeof(int));
+    for (size_t e = 0; e < queued; ++e) ++waves[batch->queue[e].wave + 1];
+    for (int w = 0; w < waves_count; ++w) waves[w + 1] += waves[w];
+    for (size_t e = 0; e < queued; ++e) batch->sorted_queue[waves[batch->queue[e].wave]++] = batch->queue[e];
+
+    int wave_first = 0;
+    for (int w = 0; w < waves_count; ++w)
+    {
+        const int wave_end = waves[w];
+
+        // counting sort of the wave by chunk, stable so the paths of a chunk stay in batch order
+        int* offsets = batch->chunk_offsets;
+        memset(offsets, 0, (stream->chunks_count + 1) * sizeof(int));
+        for (int e = wave_first; e < wave_end; ++e) ++offsets[batch->sorted_queue[e].chunk + 1];
+        for (int c = 0; c < stream->chunks_count; ++c) offsets[c + 1] += offsets[c];
+        for (int e = wave_first; e < wave_end; ++e)
+        {
+            batch->queue[wave_first + offsets[batch->sorted_queue[e].chunk]++] = batch->sorted_queue[e];
+        }
+
+        // each chunk is paged in once per wave for all of its paths
+        int first = wave_first;
+        for (int c = 0; c < stream->chunks_count; ++c)
+        {
+            const int end = wave_first + offsets[c];
+            if (first == end) continue;
+
+            hittable_array_list view;
+            bool acquired = false;
+            for (int e = first; e < end; ++e)
+            {
+                const ray_queue_entry* entry = &batch->queue[e];
+                ray_path* p = &batch->paths[entry->path];
+
+                // a closer hit in a nearer chunk already occludes this one
+                interval t_interval = interval_ray;
+                if (batch->hits[entry->path]) t_interval.v_max = p->rec.t;
+                if (entry->t_enter > t_interval.v_max) continue;
+
+                if (!acquired)
+                {
+                    geo_stream_acquire(stream, c, &view);
+                    acquired = true;
+                }
+
+                if (deterministic) rng_thread = p->rng;
+                hit_record rec;
+                if (bvh_raytest(&view, &p->r, t_interval, &rec))
+                {
+                    batch->hit_materials[entry->path] = *rec.mat;
+                    p->rec = rec;
+                    p->rec.mat = &batch->hit_materials[entry->path];
+                    p->rec.obj = NULL;
+                    batch->hits[entry->path] = true;
+                }
+                if (deterministic) p->rng = rng_thread;
+            }
+            if (acquired) geo_stream_release(stream, c);
+            first = end;
+        }
+        wave_first = wave_end;
+    }
+}
+
+void path_contribute(ray_path* p, c3f radiance, c3f* colors, c3f* aovs)
+{
+    const c3f weighted = v3f_mul_comp(p->throughput, radiance);
+    colors[p->pixel] = v3f_add(colors[p->pixel], weighted);
+    if (aovs)
+    {
+        c3f* target = &aovs[p->pixel * CAMERA_AOV_COUNT + (p->aov < 0 ? CAMERA_AOV_BACKGROUND : p->aov)];
+        *target = v3f_add(*target, weighted);
+    }
+}
+
+size_t ray_batch_shade(ray_batch* batch, size_t count, bool deterministic)
+{
+    // bucket the hits by material type, then run one kernel per bucket
+    size_t offsets[EMaterialType_COUNT + 1] = { 0 };
+    for (size_t i = 0; i < count; ++i) ++offsets[batch->paths[i].rec.mat->type + 1];
+    for (int t = 0; t < EMaterialType_COUNT; ++t) offsets[t + 1] += offsets[t];
+
+    size_t cursor[EMaterialType_COUNT];
+    memcpy(cursor, offsets, sizeof(cursor));
+    for (size_t i = 0; i < count; ++i)
+    {
+        batch->sorted[cursor[batch->paths[i].rec.mat->type]++] = batch->paths[i];
+    }
+
+    size_t alive = 0;
+#define X_SHADE_BUCKET(NAME, member) \
+    alive += scatter_all_##member( \
+        &batch->sorted[offsets[EMaterialType_##NAME]], \
+        offsets[EMaterialType_##NAME + 1] - offsets[EMaterialType_##NAME], \
+        &batch->sorted[alive], \
+        deterministic);
+    MATERIAL_TYPES(X_SHADE_BUCKET)
+#undef X_SHADE_BUCKET
+
+    ray_batch_swap(batch);
+    return alive;
+}
+
+void ray_batch_sort_by_coherence(ray_batch* batch, size_t count)
+{
+    if (count < 2) return;
+
+    p3f lo = batch->paths[0].r.origin;
+    p3f hi = lo;
+    for (size_t i = 1; i < count; ++i)
+    {
+        const p3f o = batch->paths[i].r.origin;
+        lo = (p3f){ .x = fminf(lo.x, o.x), .y = fminf(lo.y, o.y), .z = fminf(lo.z, o.z) };
+        hi = (p3f){ .x = fmaxf(hi.x, o.x), .y = fmaxf(hi.y, o.y), .z = fmaxf(hi.z, o.z) };
+    }
+
+    const v3f extent = v3f_sub(hi, lo);
+    const v3f inv_extent = {
+        .x = extent.x > 0.f ? 1.f / extent.x : 0.f,
+        .y = extent.y > 0.f ? 1.f / extent.y : 0.f,
+        .z = extent.z > 0.f ? 1.f / extent.z : 0.f
+    };
+    for (size_t i = 0; i < count; ++i)
+    {
+        batch->keys[i] = coherence_key(&batch->paths[i].r, lo, inv_extent);
+    }
+
+    // LSD radix sort, two 8 bit digits
+    for (int shift = 0; shift < 16; shift += 8)
+    {
+        size_t histogram[257] = { 0 };
+        for (size_t i = 0; i < count; ++i) ++histogram[((batch->keys[i] >> shift) & 0xFF) + 1];
+        for (int d = 0; d < 256; ++d) histogram[d + 1] += histogram[d];
+
+        for (size_t i = 0; i < count; ++i)
+        {
+            const size_t dst = histogram[(batch->keys[i] >> shift) & 0xFF]++;
+            batch->sorted[dst] = batch->paths[i];
+            batch->sorted_keys[dst] = batch->keys[i];
+        }
+        ray_batch_swap(batch);
+    }
+}
+
+void ray_batch_swap(ray_batch* batch)
+{
+    ray_path* paths = batch->paths;
+    batch->paths = batch->sorted;
+    batch->sorted = paths;
+
+    unsigned short* keys = batch->keys;
+    batch->keys = batch->sorted_keys;
+    batch->sorted_keys = keys;
+}
+
+unsigned short coherence_key(ray* r, p3f lo, v3f inv_extent)
+{
+    // direction octant in the top bits, then the origin cell on a morton curve
+    const unsigned cells = (1u << COHERENCE_GRID_BITS) - 1;
+    const v3f o = v3f_sub(r->origin, lo);
+    const unsigned qx = (unsigned)(o.x * inv_extent.x * cells);
+    const unsigned qy = (unsigned)(o.y * inv_extent.y * cells);
+    const unsigned qz = (unsigned)(o.z * inv_extent.z * cells);
+
+    unsigned key = (r->dir.x < 0.f) | ((r->dir.y < 0.f) << 1) | ((r->dir.z < 0.f) << 2);
+    for (int bit = COHERENCE_GRID_BITS - 1; bit >= 0; --bit)
+    {
+        key = (key << 3)
+            | (((qx >> bit) & 1u) << 2)
+            | (((qy >> bit) & 1u) << 1)
+            | ((qz >> bit) & 1u);
+    }
+    return (unsigned short)key;
+}
+
+#undef COHERENCE_GRID_BITS
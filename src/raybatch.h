@@ -0,0 +1,74 @@
+#pragma once
+
+#include "defs.h"
+#include "vec3f.h"
+#include "camera.h"
+#include "hittable.h"
+#include "ray.h"
+#include "rng.h"
+
+typedef struct ray_path ray_path;
+typedef struct ray_batch ray_batch;
+typedef struct ray_queue_entry ray_queue_entry;
+
+struct ray_path
+{
+    ray r;
+    c3f throughput;
+    int pixel; // index inside the tile
+    int aov;   // see CAMERA_AOV_COUNT, -1 until the primary ray is traced
+    rng_state rng; // stream of the path in deterministic renders, resumed at every step
+    hit_record rec;
+};
+
+// A path waiting at one chunk of a streamed scene, see geostream.h
+struct ray_queue_entry
+{
+    int path;
+    int chunk;
+    int wave; // the chunk is the wave-th nearest one of the path
+    f32 t_enter;
+};
+
+// Per worker storage for tracing a tile breadth-first. Between bounces the paths
+// are sorted by the material they hit before shading and by origin and direction
+// before the next intersection, so neighbouring paths touch the same scene data.
+struct ray_batch
+{
+    size_t capacity;
+    ray_path* paths;
+    ray_path* sorted;
+    unsigned short* keys;
+    unsigned short* sorted_keys;
+
+    // queued tracing of streamed scenes, allocated on first use
+    ray_queue_entry* queue;
+    ray_queue_entry* sorted_queue;
+    size_t queue_capacity;
+    int* chunk_offsets;     // chunks_count + 1
+    int* wave_offsets;
+    int waves_capacity;
+    int* candidates;
+    f32* candidates_t;
+    int candidates_capacity;
+    material* hit_materials; // capacity, hits keep their material once the chunk is released
+    bool* hits;              // capacity
+};
+
+void ray_batch_init(ray_batch* batch, size_t capacity);
+void ray_batch_delete(ray_batch* batch);
+
+// Bytes a batch allocates while tracing world, the queue of a streamed world is estimated
+size_t ray_batch_bytes(size_t capacity, hittable_array_list* world);
+
+// Adds the radiance of all samples of the tile pixels to colors (rect.width * rect.height)
+// and, unless aovs is NULL, to the CAMERA_AOV_COUNT aovs of every pixel. Returns the
+// number of rays traced.
+long long ray_batch_render_tile(
+    ray_batch* batch,
+    camera* cam,
+    hittable_array_list* world,
+    pixel_rect rect,
+    int samples,
+    c3f* colors,
+    c3f* aovs);
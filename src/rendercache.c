@@ -0,0 +1,352 @@
+#include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+#include "rendercache.h"
+#include "geostream.h"
+
+#define WIN32_LEAN_AND_MEAN
+#include "windows.h"
+
+// Utils
+#define RENDER_CACHE_VERSION 5u // bump when the hashed inputs or the radiance math change
+#define FNV_OFFSET 0xCBF29CE484222325ull
+#define FNV_PRIME 0x100000001B3ull
+
+typedef struct render_cache_header
+{
+    char magic[4];
+    unsigned version;
+    unsigned long long key;
+    int width;
+    int height;
+    int aovs_count; // 0 without aovs
+    int samples;
+} render_cache_header;
+
+static void hash_bytes(unsigned long long* h, const void* data, size_t size);
+static void hash_int(unsigned long long* h, int v);
+static void hash_f32(unsigned long long* h, f32 v);
+static void hash_v3f(unsigned long long* h, v3f v);
+static void hash_aabb(unsigned long long* h, aabb* box);
+static void hash_texture(unsigned long long* h, texture* tex);
+static void hash_material(unsigned long long* h, material* mat);
+static void hash_lambertian(unsigned long long* h, struct lambertian_params* p);
+static void hash_metal(unsigned long long* h, struct metal_params* p);
+static void hash_dielectric(unsigned long long* h, struct dielectric_params* p);
+static void hash_isotropic(unsigned long long* h, struct isotropic_params* p);
+static void hash_sphere(unsigned long long* h, sphere* s);
+static void hash_quad(unsigned long long* h, quad* q);
+static void hash_box(unsigned long long* h, box* b);
+static void hash_medium(unsigned long long* h, medium* m);
+static int  stored_entry_samples(const char* path, unsigned long long key);
+static void cache_path(char* path, size_t size, const char* dir, unsigned long long key, const char* extension);
+
+
+unsigned long long render_cache_key(hittable_array_list* world, camera* cam)
+{
+    // field by field, raw struct bytes would include padding and pointers
+    unsigned long long h = FNV_OFFSET;
+    hash_int(&h, RENDER_CACHE_VERSION);
+
+    hash_int(&h, (int)world->size);
+    for (size_t i = 0; i < world->size; ++i)
+    {
+        hittable* obj = &world->data[i];
+        hash_int(&h, obj->type);
+        switch (obj->type)
+        {
+#define X_HITTABLE_HASH(NAME, type, member) case EHittableType_##NAME: hash_##type(&h, &obj->member); break;
+        HITTABLE_TYPES(X_HITTABLE_HASH)
+#undef X_HITTABLE_HASH
+        default: break;
+        }
+    }
+
+    // streamed objects are not read back, the content hashes written with the chunks stand in for them
+    hash_int(&h, world->stream != NULL);
+    if (world->stream) hash_bytes(&h, &world->stream->content_hash, sizeof(world->stream->content_hash));
+    for (int c = 0; world->stream && c < world->stream->chunks_count; ++c)
+    {
+        geo_chunk* chunk = &world->stream->chunks[c];
+        hash_aabb(&h, &chunk->bounds);
+        hash_int(&h, chunk->objects_count);
+        hash_bytes(&h, &chunk->hash, sizeof(chunk->hash));
+    }
+
+    // samples_per_px, threads and output paths leave the per sample radiance unchanged
+    hash_f32(&h, cam->fov);
+    hash_v3f(&h, cam->lookfrom);
+    hash_v3f(&h, cam->lookat);
+    hash_v3f(&h, cam->vup);
+    hash_f32(&h, cam->aspect_ration);
+    hash_f32(&h, cam->defocus_angle);
+    hash_f32(&h, cam->focus_dist);
+    hash_f32(&h, cam->shutter_open);
+    hash_f32(&h, cam->shutter_close);
+    hash_int(&h, cam->image_width);
+    hash_int(&h, cam->image_height);
+    hash_int(&h, cam->max_depth);
+    hash_int(&h, cam->crop.x);
+    hash_int(&h, cam->crop.y);
+    hash_int(&h, cam->crop.width);
+    hash_int(&h, cam->crop.height);
+    hash_int(&h, cam->ray_batching);
+    hash_int(&h, cam->aovs);
+    hash_int(&h, cam->deterministic);
+    hash_f32(&h, cam->irradiance_error);
+    return h;
+}
+
+int render_cache_load(const char* dir, unsigned long long key, camera* cam)
+{
+    char path[260];
+    cache_path(path, sizeof(path), dir, key, "rcache");
+
+    FILE* file = NULL;
+    fopen_s(&file, path, "rb");
+    if (!file)
+    {
+        fprintf_s(stderr, "Render cache... MISS\n");
+        return 0;
+    }
+
+    const size_t pixels_count = (size_t)cam->image_width * cam->image_height;
+    const int aovs_count = cam->aovs ? CAMERA_AOV_COUNT : 0;
+    const size_t sums_count = pixels_count * (1 + aovs_count);
+
+    render_cache_header header;
+    bool ok = fread(&header, sizeof(header), 1, file) == 1
+        && memcmp(header.magic, "RTRC", 4) == 0
+        && header.version == RENDER_CACHE_VERSION
+        && header.key == key
+        && header.width == cam->image_width
+        && header.height == cam->image_height
+        && header.aovs_count == aovs_count
+        && header.samples > 0
+        && header.samples <= cam->samples_per_px; // more samples would not be the requested image
+
+    // the sums are only taken over once all of them were read
+    c3f* sums = NULL;
+    if (ok)
+    {
+        sums = malloc(sums_count * sizeof(c3f));
+        if (!sums) exit(1);
+        ok = fread(sums, sizeof(c3f), sums_count, file) == sums_count;
+    }
+    fclose(file);
+
+    if (!ok)
+    {
+        free(sums);
+        fprintf_s(stderr, "Render cache... MISS | unusable entry\n");
+        return 0;
+    }
+
+    memcpy(cam->accumbuffer, sums, pixels_count * sizeof(c3f));
+    if (aovs_count) memcpy(cam->aov_accumbuffer, sums + pixels_count, pixels_count * aovs_count * sizeof(c3f));
+    free(sums);
+
+    cam->accum_samples = header.samples;
+    camera_resolve(cam);
+    fprintf_s(stderr, "Render cache... HIT | %d spp\n", header.samples);
+    return header.samples;
+}
+
+bool render_cache_store(const char* dir, unsigned long long key, camera* cam)
+{
+    if (cam->accum_samples <= 0) return false;
+
+    // a missing directory is created, an existing one is fine
+    CreateDirectoryA(dir, NULL);
+
+    char path[260];
+    char tmp_path[260];
+    cache_path(path, sizeof(path), dir, key, "rcache");
+    cache_path(tmp_path, sizeof(tmp_path), dir, key, "rcache.tmp");
+
+    // a render with fewer samples must not replace a better one
+    const int stored_samples = stored_entry_samples(path, key);
+    if (stored_samples >= cam->accum_samples)
+    {
+        fprintf_s(stderr, "Render cache... KEPT | entry holds %d spp\n", stored_samples);
+        return true;
+    }
+
+    const size_t pixels_count = (size_t)cam->image_width * cam->image_height;
+    const int aovs_count = cam->aovs ? CAMERA_AOV_COUNT : 0;
+    const render_cache_header header = {
+        .magic = { 'R', 'T', 'R', 'C' },
+        .version = RENDER_CACHE_VERSION,
+        .key = key,
+        .width = cam->image_width,
+        .height = cam->image_height,
+        .aovs_count = aovs_count,
+        .samples = cam->accum_samples
+    };
+
+    // write aside and swap so concurrent jobs never read a half written entry
+    FILE* file = NULL;
+    fopen_s(&file, tmp_path, "wb");
+    if (!file) return false;
+
+    bool ok = fwrite(&header, sizeof(header), 1, file) == 1
+        && fwrite(cam->accumbuffer, sizeof(c3f), pixels_count, file) == pixels_count;
+    if (ok && aovs_count)
+    {
+        ok = fwrite(cam->aov_accumbuffer, sizeof(c3f), pixels_count * aovs_count, file) == pixels_count * aovs_count;
+    }
+    ok = fclose(file) == 0 && ok;
+
+    ok = ok && MoveFileExA(tmp_path, path, MOVEFILE_REPLACE_EXISTING);
+    if (!ok) DeleteFileA(tmp_path);
+    return ok;
+}
+
+void hash_bytes(unsigned long long* h, const void* data, size_t size)
+{
+    const unsigned char* bytes = data;
+    for (size_t i = 0; i < size; ++i)
+    {
+        *h = (*h ^ bytes[i]) * FNV_PRIME;
+    }
+}
+
+void hash_int(unsigned long long* h, int v)
+{
+    hash_bytes(h, &v, sizeof(v));
+}
+
+void hash_f32(unsigned long long* h, f32 v)
+{
+    // -0 and 0 are the same input
+    v += 0.f;
+    hash_bytes(h, &v, sizeof(v));
+}
+
+void hash_v3f(unsigned long long* h, v3f v)
+{
+    hash_f32(h, v.x);
+    hash_f32(h, v.y);
+    hash_f32(h, v.z);
+}
+
+void hash_aabb(unsigned long long* h, aabb* box)
+{
+    hash_v3f(h, box->lo);
+    hash_v3f(h, box->hi);
+}
+
+void hash_texture(unsigned long long* h, texture* tex)
+{
+    if (!tex)
+    {
+        hash_int(h, 0);
+        return;
+    }
+    hash_int(h, 1);
+    hash_bytes(h, tex->path, strlen(tex->path));
+
+    // reading every texel would cost a pass over the image, an edit changes the
+    // size or write time of the image and of the rebuilt tile file instead
+    texture_stamp stamp;
+    hash_int(h, texture_get_stamp(tex, &stamp));
+    hash_bytes(h, &stamp, sizeof(stamp));
+    hash_int(h, tex->levels);
+    for (int level = 0; level < tex->levels; ++level)
+    {
+        hash_int(h, tex->width[level]);
+        hash_int(h, tex->height[level]);
+    }
+}
+
+void hash_material(unsigned long long* h, material* mat)
+{
+    hash_int(h, mat->type);
+    switch (mat->type)
+    {
+#define X_MATERIAL_HASH(NAME, member) case EMaterialType_##NAME: hash_##member(h, &mat->member); break;
+    MATERIAL_TYPES(X_MATERIAL_HASH)
+#undef X_MATERIAL_HASH
+    default: break;
+    }
+}
+
+void hash_lambertian(unsigned long long* h, struct lambertian_params* p)
+{
+    hash_v3f(h, p->albedo);
+    hash_texture(h, p->albedo_tex);
+}
+
+void hash_metal(unsigned long long* h, struct metal_params* p)
+{
+    hash_v3f(h, p->albedo);
+    hash_f32(h, p->fuzz);
+    hash_texture(h, p->albedo_tex);
+    hash_texture(h, p->roughness_tex);
+}
+
+void hash_dielectric(unsigned long long* h, struct dielectric_params* p)
+{
+    hash_f32(h, p->ir);
+}
+
+void hash_isotropic(unsigned long long* h, struct isotropic_params* p)
+{
+    hash_v3f(h, p->albedo);
+}
+
+void hash_sphere(unsigned long long* h, sphere* s)
+{
+    hash_v3f(h, s->center);
+    hash_int(h, s->is_moving);
+    if (s->is_moving) hash_v3f(h, s->center1);
+    hash_f32(h, s->radius);
+    hash_material(h, &s->mat);
+}
+
+void hash_quad(unsigned long long* h, quad* q)
+{
+    // normal, d and w derive from q, u and v
+    hash_v3f(h, q->q);
+    hash_v3f(h, q->u);
+    hash_v3f(h, q->v);
+    hash_material(h, &q->mat);
+}
+
+void hash_box(unsigned long long* h, box* b)
+{
+    hash_aabb(h, &b->bounds);
+    hash_material(h, &b->mat);
+}
+
+void hash_medium(unsigned long long* h, medium* m)
+{
+    hash_aabb(h, &m->boundary);
+    hash_f32(h, m->density);
+    hash_material(h, &m->mat);
+}
+
+int stored_entry_samples(const char* path, unsigned long long key)
+{
+    FILE* file = NULL;
+    fopen_s(&file, path, "rb");
+    if (!file) return 0;
+
+    render_cache_header header;
+    const bool ok = fread(&header, sizeof(header), 1, file) == 1
+        && memcmp(header.magic, "RTRC", 4) == 0
+        && header.version == RENDER_CACHE_VERSION
+        && header.key == key;
+    fclose(file);
+    return ok ? header.samples : 0;
+}
+
+void cache_path(char* path, size_t size, const char* dir, unsigned long long key, const char* extension)
+{
+    sprintf_s(path, size, "%s/%016llx.%s", dir, key, extension);
+}
+
+#undef WIN32_LEAN_AND_MEAN
+#undef RENDER_CACHE_VERSION
+#undef FNV_OFFSET
+#undef FNV_PRIME
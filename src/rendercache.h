@@ -0,0 +1,22 @@
+#pragma once
+
+#include "defs.h"
+#include "camera.h"
+#include "hittable.h"
+
+// On-disk store of linear accumulation buffers, one <key>.rcache file per render
+// in a cache directory. The key covers everything that decides the radiance sums
+// except the sample count, so an entry with fewer samples can be resumed.
+
+// Canonical hash of the primitives, materials, camera and render settings,
+// cam has to be initialized
+unsigned long long render_cache_key(hittable_array_list* world, camera* cam);
+
+// Loads the sums cached under key into the camera buffers and returns how many
+// samples they hold, 0 when there is no entry for the current image layout or
+// the entry holds more samples than the camera asks for
+int  render_cache_load(const char* dir, unsigned long long key, camera* cam);
+
+// Stores the camera buffers under key, replacing an entry with fewer samples. An
+// entry with at least as many samples is kept and counts as stored.
+bool render_cache_store(const char* dir, unsigned long long key, camera* cam);
@@ -0,0 +1,4 @@
+#include "rng.h"
+
+// a fixed start, scene setup on the main thread draws the same numbers every run
+__declspec(thread) rng_state rng_thread = { .path = 0, .key = 0x853C49E6748FEA9Bull, .counter = 0 };
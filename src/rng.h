@@ -0,0 +1,62 @@
+#pragma once
+
+#include "defs.h"
+
+typedef struct rng_state rng_state;
+
+// Counter based stream, every number is a hash of the key and its position in
+// the stream, so a key alone decides the whole sequence.
+struct rng_state
+{
+    unsigned long long path;    // identity of the path, see rng_begin_path
+    unsigned long long key;     // path and bounce
+    unsigned long long counter; // dimension inside the bounce
+};
+
+// Stream of the calling thread, rand01 and the v3f_random helpers draw from it
+extern __declspec(thread) rng_state rng_thread;
+
+// splitmix64 finalizer
+inline unsigned long long rng_mix(unsigned long long v)
+{
+    v = (v ^ (v >> 30)) * 0xBF58476D1CE4E5B9ull;
+    v = (v ^ (v >> 27)) * 0x94D049BB133111EBull;
+    return v ^ (v >> 31);
+}
+
+// Free running stream for renders which don't need to be reproducible
+inline void rng_seed_thread(unsigned long long seed)
+{
+    rng_thread.path = rng_mix(seed);
+    rng_thread.key = rng_thread.path;
+    rng_thread.counter = 0;
+}
+
+// Starts the numbers of one camera sample, id has to be unique among the paths
+// of a render, pixels use their image index. Draws up to the first bounce are
+// the camera dimensions: pixel jitter, lens and time.
+inline void rng_begin_path(unsigned long long id, unsigned sample)
+{
+    rng_thread.path = rng_mix(rng_mix(id) ^ sample);
+    rng_thread.key = rng_thread.path;
+    rng_thread.counter = 0;
+}
+
+// Numbers drawn from here on derive from (path, bounce, dimension) only
+inline void rng_begin_bounce(int bounce)
+{
+    rng_thread.key = rng_mix(rng_thread.path + (unsigned long long)(bounce + 1) * 0x9E3779B97F4A7C15ull);
+    rng_thread.counter = 0;
+}
+
+// [0, 1) with 24 bits, every f32 in the range is exact
+inline f32 rand01()
+{
+    const unsigned long long v = rng_mix(rng_thread.key + ++rng_thread.counter * 0x9E3779B97F4A7C15ull);
+    return (f32)(v >> 40) * (1.f / 16777216.f);
+}
+
+inline f32 rand_range(f32 v_min, f32 v_max)
+{
+    return v_min + (v_max - v_min) * rand01();
+}
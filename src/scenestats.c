@@ -0,0 +1,166 @@
+#include "stdio.h"
+#include "stddef.h"
+#include "string.h"
+#include "scenestats.h"
+#include "bvh.h"
+#include "geostream.h"
+#include "telemetry.h"
+
+
+// Utils
+static void print_bytes(const char* label, size_t bytes);
+
+static const char* hittable_names[EHittableType_COUNT] = {
+#define X_HITTABLE_NAME(NAME, type, member) #type,
+    HITTABLE_TYPES(X_HITTABLE_NAME)
+#undef X_HITTABLE_NAME
+};
+
+static const char* material_names[EMaterialType_COUNT] = {
+#define X_MATERIAL_NAME(NAME, member) #member,
+    MATERIAL_TYPES(X_MATERIAL_NAME)
+#undef X_MATERIAL_NAME
+};
+
+
+void scene_stats_collect(scene_stats* stats, hittable_array_list* world, camera* cam, size_t texture_cache_bytes)
+{
+    memset(stats, 0, sizeof(*stats));
+
+    // every primitive embeds one material, the union is as large as the largest one
+    for (size_t i = 0; i < world->size; ++i)
+    {
+        hittable* obj = &world->data[i];
+        size_t used = sizeof(hittable);
+        material* mat = NULL;
+        switch (obj->type)
+        {
+#define X_HITTABLE_USED(NAME, type, member) \
+        case EHittableType_##NAME: \
+            used = offsetof(hittable, member) + sizeof(type); \
+            mat = &obj->member.mat; \
+            ++stats->objects_count[EHittableType_##NAME]; \
+            break;
+        HITTABLE_TYPES(X_HITTABLE_USED)
+#undef X_HITTABLE_USED
+        default: break;
+        }
+
+        if (mat) ++stats->materials_count[mat->type];
+        stats->geometry_bytes += used - sizeof(material);
+        stats->material_bytes += sizeof(material);
+        stats->padding_bytes += sizeof(hittable) - used;
+    }
+
+    stats->slack_bytes = (world->capacity - world->size) * sizeof(hittable);
+    stats->bvh_bytes = world->bvh_nodes_count * sizeof(bvh_node);
+
+    if (cam->mt_render && cam->topology.nodes_count > 1)
+    {
+        stats->replica_bytes = cam->topology.nodes_count * (world->size * sizeof(hittable) + stats->bvh_bytes);
+    }
+
+    const size_t pixels_count = (size_t)cam->image_width * cam->image_height;
+    stats->framebuffer_bytes = 2 * pixels_count * sizeof(c3f);
+    if (cam->aovs) stats->framebuffer_bytes += CAMERA_AOV_COUNT * pixels_count * sizeof(c3f);
+
+    stats->texture_cache_bytes = texture_cache_bytes;
+    stats->batch_bytes = camera_batch_bytes(cam, world);
+    stats->irradiance_bytes = camera_irradiance_bytes(cam);
+
+    // streamed objects are not in the list, only the index stays resident
+    if (world->stream)
+    {
+        geo_stream* stream = world->stream;
+        for (int c = 0; c < stream->chunks_count; ++c) stats->streamed_objects_count += stream->chunks[c].objects_count;
+        stats->stream_index_bytes = stream->chunks_count * sizeof(geo_chunk) + stream->top_nodes_count * sizeof(bvh_node);
+        stats->stream_budget_bytes = stream->budget_bytes;
+    }
+
+    stats->total_bytes = world->capacity * sizeof(hittable)
+        + stats->bvh_bytes
+        + stats->replica_bytes
+        + stats->framebuffer_bytes
+        + stats->texture_cache_bytes
+        + stats->batch_bytes
+        + stats->irradiance_bytes
+        + stats->stream_index_bytes
+        + stats->stream_budget_bytes;
+}
+
+void scene_stats_print(scene_stats* stats)
+{
+    fprintf_s(stderr, "Scene statistics...\n");
+    for (int t = 0; t < EHittableType_COUNT; ++t)
+    {
+        if (stats->objects_count[t]) fprintf_s(stderr, "  %-16s %10zu\n", hittable_names[t], stats->objects_count[t]);
+    }
+    for (int m = 0; m < EMaterialType_COUNT; ++m)
+    {
+        if (stats->materials_count[m]) fprintf_s(stderr, "  %-16s %10zu\n", material_names[m], stats->materials_count[m]);
+    }
+
+    if (stats->streamed_objects_count) fprintf_s(stderr, "  %-16s %10zu\n", "streamed", stats->streamed_objects_count);
+
+    print_bytes("geometry", stats->geometry_bytes);
+    print_bytes("materials", stats->material_bytes);
+    print_bytes("union padding", stats->padding_bytes);
+    print_bytes("list slack", stats->slack_bytes);
+    print_bytes("bvh", stats->bvh_bytes);
+    if (stats->replica_bytes) print_bytes("node replicas", stats->replica_bytes);
+    print_bytes("framebuffers", stats->framebuffer_bytes);
+    if (stats->batch_bytes) print_bytes("ray batches", stats->batch_bytes);
+    if (stats->irradiance_bytes) print_bytes("irradiance", stats->irradiance_bytes);
+    print_bytes("texture cache", stats->texture_cache_bytes);
+    if (stats->stream_index_bytes)
+    {
+        print_bytes("stream index", stats->stream_index_bytes);
+        print_bytes("stream budget", stats->stream_budget_bytes);
+    }
+    print_bytes("total", stats->total_bytes);
+}
+
+void scene_stats_calibrate(scene_stats* stats, hittable_array_list* world, camera* cam)
+{
+    // one time setup like the irradiance cache and the node replicas stays out of the
+    // measurement, a warm-up pass takes the first stream page-ins and texture reads
+    camera_prepare(cam, world);
+    camera_reset(cam);
+    camera_render_pass(cam, world, 1);
+    camera_reset(cam);
+
+    // passes of 1 and 2 samples split the per pass cost, thread start-up and the
+    // tile queue, from the per sample cost, the full render pays the former once
+    f64 start = telemetry_now();
+    camera_render_pass(cam, world, 1);
+    const f64 one_sample_seconds = telemetry_now() - start;
+    const long long one_sample_rays = cam->rays_traced;
+    camera_reset(cam);
+
+    start = telemetry_now();
+    camera_render_pass(cam, world, 2);
+    const f64 two_samples_seconds = telemetry_now() - start;
+    const long long two_samples_rays = cam->rays_traced;
+    camera_reset(cam);
+
+    // rays and seconds of the same sample, so the rate is the per sample one too
+    const bool split = two_samples_seconds > one_sample_seconds;
+    const f64 sample_seconds = split ? two_samples_seconds - one_sample_seconds : one_sample_seconds;
+    stats->calibration_rays = split ? two_samples_rays - one_sample_rays : one_sample_rays;
+    const f64 pass_seconds = one_sample_seconds > sample_seconds ? one_sample_seconds - sample_seconds : 0.0;
+    stats->calibration_seconds = sample_seconds;
+    stats->estimated_seconds = pass_seconds + sample_seconds * cam->samples_per_px;
+
+    const int eta_s = (int)stats->estimated_seconds;
+    fprintf_s(stderr, "Calibration... 1 spp in %.2fs | %.2f Mrays/s | estimated %d spp render %02d:%02d:%02d\n",
+        stats->calibration_seconds,
+        stats->calibration_seconds > 0.0 ? stats->calibration_rays / stats->calibration_seconds * 1e-6 : 0.0,
+        cam->samples_per_px,
+        eta_s / 3600, (eta_s / 60) % 60, eta_s % 60);
+}
+
+void print_bytes(const char* label, size_t bytes)
+{
+    if (bytes >= 1024 * 1024) fprintf_s(stderr, "  %-16s %10.2f MB\n", label, bytes / (1024.0 * 1024.0));
+    else fprintf_s(stderr, "  %-16s %10.2f KB\n", label, bytes / 1024.0);
+}
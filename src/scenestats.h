@@ -0,0 +1,41 @@
+#pragma once
+
+#include "stddef.h"
+#include "defs.h"
+#include "camera.h"
+#include "hittable.h"
+
+typedef struct scene_stats scene_stats;
+
+// Memory footprint of a scene ready to render, sizes in bytes
+struct scene_stats
+{
+    size_t objects_count[EHittableType_COUNT];
+    size_t materials_count[EMaterialType_COUNT];
+    size_t streamed_objects_count;
+    size_t geometry_bytes;  // objects without their embedded material
+    size_t material_bytes;
+    size_t padding_bytes;   // union space unused by the smaller primitive types
+    size_t slack_bytes;     // allocated but unused list capacity
+    size_t bvh_bytes;
+    size_t replica_bytes;   // per node scene copies kept by the camera
+    size_t batch_bytes;     // ray batches of all workers
+    size_t irradiance_bytes; // bound of the irradiance cache
+    size_t framebuffer_bytes;
+    size_t texture_cache_bytes;
+    size_t stream_index_bytes;  // chunk table and top level tree of a streamed scene
+    size_t stream_budget_bytes; // upper bound of its mapped chunks
+    size_t total_bytes;
+
+    // filled by scene_stats_calibrate
+    f64 calibration_seconds; // one sample per pixel, without the per pass cost
+    long long calibration_rays; // traced in that sample
+    f64 estimated_seconds;
+};
+
+void scene_stats_collect(scene_stats* stats, hittable_array_list* world, camera* cam, size_t texture_cache_bytes);
+void scene_stats_print(scene_stats* stats);
+
+// Renders passes of one and two samples per pixel after a warm-up pass and
+// extrapolates the time of the full render, the camera is reset afterwards.
+void scene_stats_calibrate(scene_stats* stats, hittable_array_list* world, camera* cam);
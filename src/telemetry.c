@@ -0,0 +1,174 @@
+#include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+#include "malloc.h"
+#include "telemetry.h"
+
+#define WIN32_LEAN_AND_MEAN
+#include "windows.h"
+
+
+// Utils
+typedef struct telemetry_totals
+{
+    long long tiles;
+    long long samples;
+    long long rays;
+    f64 elapsed;
+} telemetry_totals;
+
+static telemetry_totals telemetry_sum(telemetry* tm);
+static void telemetry_write_json(telemetry* tm, telemetry_totals* totals, const char* state);
+static f64  ticks_to_seconds(long long ticks);
+
+
+void telemetry_begin(telemetry* tm, int workers_count, long long tiles_total, long long samples_total, const char* json_path, bool quiet)
+{
+    tm->workers = _aligned_malloc(workers_count * sizeof(telemetry_counters), TELEMETRY_CACHE_LINE);
+    if (!tm->workers) exit(1);
+    memset(tm->workers, 0, workers_count * sizeof(telemetry_counters));
+
+    tm->workers_count = workers_count;
+    tm->tiles_total = tiles_total;
+    tm->samples_total = samples_total;
+    tm->start = telemetry_now();
+    tm->json_path = json_path;
+    tm->quiet = quiet;
+}
+
+void telemetry_end(telemetry* tm, bool cancelled)
+{
+    telemetry_totals totals = telemetry_sum(tm);
+
+    if (!tm->quiet)
+    {
+        if (cancelled)
+        {
+            fprintf_s(stderr, "\rRender progress... CANCELLED\n");
+        }
+        else
+        {
+            fprintf_s(stderr, "\rRender progress... DONE | %.2fs | %lld rays | %.2f Mrays/s\n",
+                totals.elapsed,
+                totals.rays,
+                totals.elapsed > 0.0 ? totals.rays / totals.elapsed * 1e-6 : 0.0);
+        }
+
+        if (tm->workers_count > 1)
+        {
+            fprintf_s(stderr, "Thread utilization...");
+            for (int t = 0; t < tm->workers_count; ++t)
+            {
+                const f64 busy = ticks_to_seconds(tm->workers[t].busy_ticks);
+                fprintf_s(stderr, " %3.0f%%", totals.elapsed > 0.0 ? busy * 100.0 / totals.elapsed : 0.0);
+            }
+            fprintf_s(stderr, "\n");
+        }
+    }
+
+    telemetry_write_json(tm, &totals, cancelled ? "cancelled" : "done");
+
+    _aligned_free(tm->workers);
+    tm->workers = NULL;
+}
+
+void telemetry_report(telemetry* tm)
+{
+    telemetry_totals totals = telemetry_sum(tm);
+
+    // ETA from the sample rate so far, samples are a finer grain than tiles
+    const f64 done = tm->samples_total > 0 ? (f64)totals.samples / tm->samples_total : 1.0;
+    const f64 eta = done > 0.0 ? totals.elapsed * (1.0 - done) / done : 0.0;
+    const int eta_s = (int)eta;
+
+    if (!tm->quiet)
+    {
+        fprintf_s(stderr, "\rRender progress... %3d%% | ETA %02d:%02d:%02d | %.2f Mrays/s   ",
+            (int)(done * 100.0),
+            eta_s / 3600, (eta_s / 60) % 60, eta_s % 60,
+            totals.elapsed > 0.0 ? totals.rays / totals.elapsed * 1e-6 : 0.0);
+    }
+
+    telemetry_write_json(tm, &totals, "running");
+}
+
+long long telemetry_rays(telemetry* tm)
+{
+    return telemetry_sum(tm).rays;
+}
+
+void telemetry_add_tile(telemetry_counters* counters, long long samples, long long rays, long long busy_ticks)
+{
+    InterlockedExchangeAdd64(&counters->samples, samples);
+    InterlockedExchangeAdd64(&counters->rays, rays);
+    InterlockedExchangeAdd64(&counters->busy_ticks, busy_ticks);
+    InterlockedIncrement64(&counters->tiles);
+}
+
+f64 telemetry_now(void)
+{
+    return ticks_to_seconds(telemetry_ticks());
+}
+
+long long telemetry_ticks(void)
+{
+    LARGE_INTEGER counter;
+    QueryPerformanceCounter(&counter);
+    return counter.QuadPart;
+}
+
+telemetry_totals telemetry_sum(telemetry* tm)
+{
+    telemetry_totals totals = { .elapsed = telemetry_now() - tm->start };
+    for (int t = 0; t < tm->workers_count; ++t)
+    {
+        totals.tiles += tm->workers[t].tiles;
+        totals.samples += tm->workers[t].samples;
+        totals.rays += tm->workers[t].rays;
+    }
+    return totals;
+}
+
+void telemetry_write_json(telemetry* tm, telemetry_totals* totals, const char* state)
+{
+    if (!tm->json_path) return;
+
+    // write aside and swap so readers never see a half written file
+    char tmp_path[MAX_PATH];
+    sprintf_s(tmp_path, sizeof(tmp_path), "%s.tmp", tm->json_path);
+    FILE* file = NULL;
+    fopen_s(&file, tmp_path, "w");
+    if (!file) return;
+
+    fprintf_s(file, "{\n");
+    fprintf_s(file, "  \"state\": \"%s\",\n", state);
+    fprintf_s(file, "  \"elapsed_s\": %.3f,\n", totals->elapsed);
+    fprintf_s(file, "  \"tiles_done\": %lld,\n", totals->tiles);
+    fprintf_s(file, "  \"tiles_total\": %lld,\n", tm->tiles_total);
+    fprintf_s(file, "  \"samples_done\": %lld,\n", totals->samples);
+    fprintf_s(file, "  \"samples_total\": %lld,\n", tm->samples_total);
+    fprintf_s(file, "  \"rays\": %lld,\n", totals->rays);
+    fprintf_s(file, "  \"rays_per_s\": %.1f,\n", totals->elapsed > 0.0 ? totals->rays / totals->elapsed : 0.0);
+    fprintf_s(file, "  \"threads\": [");
+    for (int t = 0; t < tm->workers_count; ++t)
+    {
+        const f64 busy = ticks_to_seconds(tm->workers[t].busy_ticks);
+        fprintf_s(file, "%s\n    { \"tiles\": %lld, \"samples\": %lld, \"rays\": %lld, \"utilization\": %.3f }",
+            t ? "," : "",
+            tm->workers[t].tiles,
+            tm->workers[t].samples,
+            tm->workers[t].rays,
+            totals->elapsed > 0.0 ? busy / totals->elapsed : 0.0);
+    }
+    fprintf_s(file, "\n  ]\n}\n");
+    if (fclose(file) == 0) MoveFileExA(tmp_path, tm->json_path, MOVEFILE_REPLACE_EXISTING);
+}
+
+f64 ticks_to_seconds(long long ticks)
+{
+    LARGE_INTEGER frequency;
+    QueryPerformanceFrequency(&frequency);
+    return (f64)ticks / (f64)frequency.QuadPart;
+}
+
+#undef WIN32_LEAN_AND_MEAN
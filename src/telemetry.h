@@ -0,0 +1,45 @@
+#pragma once
+
+#include "stdio.h"
+#include "defs.h"
+
+#define TELEMETRY_CACHE_LINE 64
+
+typedef struct telemetry telemetry;
+typedef union telemetry_counters telemetry_counters;
+
+// Written only by its worker with atomic adds and read by the reporting thread,
+// every worker owns a full cache line so the writes never share one.
+union telemetry_counters
+{
+    struct
+    {
+        volatile long long tiles;
+        volatile long long samples;
+        volatile long long rays;
+        volatile long long busy_ticks;
+    };
+    char padding[TELEMETRY_CACHE_LINE];
+};
+
+struct telemetry
+{
+    telemetry_counters* workers;
+    int workers_count;
+    long long tiles_total;
+    long long samples_total;
+    f64 start;
+    const char* json_path; // NULL disables the JSON stats file
+    bool quiet;            // JSON only, no progress or end of pass lines
+};
+
+void telemetry_begin(telemetry* tm, int workers_count, long long tiles_total, long long samples_total, const char* json_path, bool quiet);
+void telemetry_end(telemetry* tm, bool cancelled);
+void telemetry_report(telemetry* tm);
+long long telemetry_rays(telemetry* tm);
+
+// Worker side
+void telemetry_add_tile(telemetry_counters* counters, long long samples, long long rays, long long busy_ticks);
+
+f64       telemetry_now(void);
+long long telemetry_ticks(void);
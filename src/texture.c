@@ -0,0 +1,579 @@
+#include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+#include "malloc.h"
+#include "math.h"
+#include "texture.h"
+
+#define WIN32_LEAN_AND_MEAN
+#include "windows.h"
+
+
+// Utils
+#define TEXTURE_CACHE_SHARDS 64
+#define TEXTURE_TILE_BYTES (TEXTURE_TILE_SIZE * TEXTURE_TILE_SIZE * 3)
+#define TEXTURE_FILE_MAGIC 0x454C4954 // 'TILE'
+#define CACHE_LINE_SIZE 64
+
+enum
+{
+    TEXTURE_STATE_NONE,
+    TEXTURE_STATE_PREPARING,
+    TEXTURE_STATE_READY,
+    TEXTURE_STATE_FAILED
+};
+
+typedef struct texture_file_header
+{
+    unsigned int magic;
+    int width;
+    int height;
+    int levels;
+    int tile_size;
+    long long source_bytes; // stamp of the image the tiles were cut from
+    long long source_time;
+} texture_file_header;
+
+// Rows of one mip level waiting to be cut into a row of tiles
+typedef struct mip_strip
+{
+    int width;
+    int height;
+    int tiles_x;
+    long long offset;
+    int rows_pushed;
+    int rows_filled;
+    unsigned char* rows;    // TEXTURE_TILE_SIZE rows
+    unsigned char* pending; // odd row waiting for its pair to be downsampled
+    unsigned char* next_row;
+    bool has_pending;
+} mip_strip;
+
+typedef struct texture_cache_slot
+{
+    unsigned long long key; // 0 marks an empty slot
+    volatile long referenced;
+    int next;               // next slot in the bucket chain, -1 ends it
+    unsigned char* texels;
+} texture_cache_slot;
+
+// Tiles are spread over independently locked shards, lookups only take the shard
+// lock shared and eviction is a clock sweep over the shard slots.
+typedef struct texture_cache_shard
+{
+    SRWLOCK lock;
+    texture_cache_slot* slots;
+    int* buckets;
+    int slots_count;
+    int buckets_count;
+    int hand;
+    char padding[CACHE_LINE_SIZE];
+} texture_cache_shard;
+
+static texture_cache_shard cache_shards[TEXTURE_CACHE_SHARDS];
+static unsigned char* cache_texels = NULL;
+static volatile long textures_count = 0;
+
+static bool texture_open_tiles(texture* tex);
+static bool texture_build_tiles(const char* src_path, const char* dst_path, long long src_bytes, long long src_time);
+static void mip_push_row(mip_strip* strips, int levels, int level, unsigned char* row, FILE* out);
+static void mip_flush_tiles(mip_strip* strip, FILE* out);
+static void texture_fetch(texture* tex, int level, int x, int y, unsigned char* rgb);
+static void texture_read_tile(texture* tex, int level, int tx, int ty, unsigned char* texels);
+static int  cache_find(texture_cache_shard* shard, int bucket, unsigned long long key);
+static int  cache_evict(texture_cache_shard* shard);
+static unsigned long long cache_hash(unsigned long long key);
+static c3f  texel_to_linear(unsigned char* rgb);
+static void file_stamp(const char* path, long long* bytes, long long* time);
+
+
+void texture_cache_init(size_t budget_bytes)
+{
+    size_t tiles = budget_bytes / TEXTURE_TILE_BYTES;
+    if (tiles < TEXTURE_CACHE_SHARDS) tiles = TEXTURE_CACHE_SHARDS;
+    const int slots_per_shard = (int)(tiles / TEXTURE_CACHE_SHARDS);
+
+    cache_texels = malloc((size_t)slots_per_shard * TEXTURE_CACHE_SHARDS * TEXTURE_TILE_BYTES);
+    if (!cache_texels) exit(1);
+
+    for (int s = 0; s < TEXTURE_CACHE_SHARDS; ++s)
+    {
+        texture_cache_shard* shard = &cache_shards[s];
+        InitializeSRWLock(&shard->lock);
+        shard->slots_count = slots_per_shard;
+        shard->buckets_count = slots_per_shard * 2;
+        shard->hand = 0;
+        shard->slots = malloc(shard->slots_count * sizeof(texture_cache_slot));
+        shard->buckets = malloc(shard->buckets_count * sizeof(int));
+        if (!shard->slots || !shard->buckets) exit(1);
+
+        for (int i = 0; i < shard->slots_count; ++i)
+        {
+            shard->slots[i] = (texture_cache_slot){
+                .key = 0,
+                .referenced = 0,
+                .next = -1,
+                .texels = cache_texels + ((size_t)s * slots_per_shard + i) * TEXTURE_TILE_BYTES
+            };
+        }
+        for (int i = 0; i < shard->buckets_count; ++i) shard->buckets[i] = -1;
+    }
+}
+
+void texture_cache_delete(void)
+{
+    for (int s = 0; s < TEXTURE_CACHE_SHARDS; ++s)
+    {
+        free(cache_shards[s].slots);
+        free(cache_shards[s].buckets);
+        cache_shards[s].slots = NULL;
+        cache_shards[s].buckets = NULL;
+    }
+    free(cache_texels);
+    cache_texels = NULL;
+}
+
+texture* texture_create(const char* path)
+{
+    texture* tex = calloc(1, sizeof(texture));
+    if (!tex) exit(1);
+
+    tex->path = _strdup(path);
+    tex->id = InterlockedIncrement(&textures_count);
+    tex->state = TEXTURE_STATE_NONE;
+    return tex;
+}
+
+void texture_delete(texture* tex)
+{
+    if (!tex) return;
+    if (tex->file) CloseHandle(tex->file);
+    free((void*)tex->path);
+    free(tex);
+}
+
+c3f texture_sample(texture* tex, f32 u, f32 v, f32 footprint)
+{
+    if (!tex || !texture_prepare(tex)) return (c3f) { .r = 1.f, .g = 0.f, .b = 1.f };
+
+    const f32 texels = footprint * tex->width[0];
+    int level = texels > 1.f ? (int)log2f(texels) : 0;
+    if (level > tex->levels - 1) level = tex->levels - 1;
+
+    const int w = tex->width[level];
+    const int h = tex->height[level];
+
+    // u wraps around, v is clamped, image row 0 is v = 1
+    u = u - floorf(u);
+    v = clamp(v, 0.f, 1.f);
+    const f32 x = u * w - 0.5f;
+    const f32 y = (1.f - v) * h - 0.5f;
+    const f32 x_floor = floorf(x);
+    const f32 y_floor = floorf(y);
+    const f32 fx = x - x_floor;
+    const f32 fy = y - y_floor;
+
+    const int x0 = ((int)x_floor % w + w) % w;
+    const int x1 = (x0 + 1) % w;
+    const int y0 = max((int)y_floor, 0);
+    const int y1 = min((int)y_floor + 1, h - 1);
+
+    unsigned char t00[3], t10[3], t01[3], t11[3];
+    texture_fetch(tex, level, x0, y0, t00);
+    texture_fetch(tex, level, x1, y0, t10);
+    texture_fetch(tex, level, x0, y1, t01);
+    texture_fetch(tex, level, x1, y1, t11);
+
+    const c3f top = v3f_add(v3f_mul(texel_to_linear(t00), 1.f - fx), v3f_mul(texel_to_linear(t10), fx));
+    const c3f bottom = v3f_add(v3f_mul(texel_to_linear(t01), 1.f - fx), v3f_mul(texel_to_linear(t11), fx));
+    return v3f_add(v3f_mul(top, 1.f - fy), v3f_mul(bottom, fy));
+}
+
+bool texture_prepare(texture* tex)
+{
+    while (true)
+    {
+        const long state = tex->state;
+        if (state == TEXTURE_STATE_READY) return true;
+        if (state == TEXTURE_STATE_FAILED) return false;
+
+        if (state == TEXTURE_STATE_NONE
+            && InterlockedCompareExchange(&tex->state, TEXTURE_STATE_PREPARING, TEXTURE_STATE_NONE) == TEXTURE_STATE_NONE)
+        {
+            const bool ok = texture_open_tiles(tex);
+            if (!ok) fprintf_s(stderr, "Loading texture '%s'... FAIL\n", tex->path);
+            InterlockedExchange(&tex->state, ok ? TEXTURE_STATE_READY : TEXTURE_STATE_FAILED);
+            return ok;
+        }
+
+        // someone else converts it
+        Sleep(1);
+    }
+}
+
+bool texture_get_stamp(texture* tex, texture_stamp* stamp)
+{
+    const bool ok = texture_prepare(tex);
+
+    char tiles_path[MAX_PATH];
+    sprintf_s(tiles_path, sizeof(tiles_path), "%s.tiles", tex->path);
+    file_stamp(tex->path, &stamp->image_bytes, &stamp->image_time);
+    file_stamp(tiles_path, &stamp->tiles_bytes, &stamp->tiles_time);
+    return ok;
+}
+
+bool texture_open_tiles(texture* tex)
+{
+    char tiles_path[MAX_PATH];
+    sprintf_s(tiles_path, sizeof(tiles_path), "%s.tiles", tex->path);
+
+    // tiles cut from an older version of the image are rebuilt
+    long long source_bytes, source_time;
+    file_stamp(tex->path, &source_bytes, &source_time);
+
+    texture_file_header header = { 0 };
+    for (int attempt = 0; attempt < 2; ++attempt)
+    {
+        FILE* file = NULL;
+        fopen_s(&file, tiles_path, "rb");
+        if (file)
+        {
+            const size_t read = fread(&header, sizeof(header), 1, file);
+            fclose(file);
+            if (read == 1
+                && header.magic == TEXTURE_FILE_MAGIC
+                && header.tile_size == TEXTURE_TILE_SIZE
+                && header.levels > 0
+                && header.levels <= TEXTURE_MAX_LEVELS
+                && header.source_bytes == source_bytes
+                && header.source_time == source_time) break;
+        }
+
+        header.magic = 0;
+        if (attempt == 0 && !texture_build_tiles(tex->path, tiles_path, source_bytes, source_time)) return false;
+    }
+    if (header.magic != TEXTURE_FILE_MAGIC) return false;
+
+    tex->levels = header.levels;
+    long long offset = sizeof(texture_file_header);
+    int w = header.width;
+    int h = header.height;
+    for (int level = 0; level < tex->levels; ++level)
+    {
+        tex->width[level] = w;
+        tex->height[level] = h;
+        tex->tiles_x[level] = (w + TEXTURE_TILE_SIZE - 1) / TEXTURE_TILE_SIZE;
+        tex->level_offset[level] = offset;
+        offset += (long long)tex->tiles_x[level] * ((h + TEXTURE_TILE_SIZE - 1) / TEXTURE_TILE_SIZE) * TEXTURE_TILE_BYTES;
+        w = max(w / 2, 1);
+        h = max(h / 2, 1);
+    }
+
+    // positioned reads, so any number of threads can page in tiles concurrently
+    HANDLE file = CreateFileA(tiles_path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE) return false;
+    tex->file = file;
+    return true;
+}
+
+bool texture_build_tiles(const char* src_path, const char* dst_path, long long src_bytes, long long src_time)
+{
+    fprintf_s(stderr, "Converting texture '%s'...\n", src_path);
+
+    FILE* in = NULL;
+    fopen_s(&in, src_path, "rb");
+    if (!in) return false;
+
+    int kind = 0, width = 0, height = 0, max_value = 0;
+    if (fscanf_s(in, "P%d %d %d %d", &kind, &width, &height, &max_value) != 4
+        || (kind != 3 && kind != 6)
+        || width <= 0 || height <= 0 || max_value <= 0 || max_value > 255)
+    {
+        fclose(in);
+        return false;
+    }
+    const bool binary = kind == 6;
+    if (binary) fgetc(in);
+
+    FILE* out = NULL;
+    fopen_s(&out, dst_path, "wb");
+    if (!out)
+    {
+        fclose(in);
+        return false;
+    }
+
+    texture_file_header header = {
+        .magic = 0, // written last, a partial file is never picked up
+        .width = width,
+        .height = height,
+        .levels = 1,
+        .tile_size = TEXTURE_TILE_SIZE,
+        .source_bytes = src_bytes,
+        .source_time = src_time
+    };
+
+    mip_strip strips[TEXTURE_MAX_LEVELS];
+    long long offset = sizeof(texture_file_header);
+    for (int w = width, h = height; header.levels <= TEXTURE_MAX_LEVELS; ++header.levels)
+    {
+        mip_strip* strip = &strips[header.levels - 1];
+        *strip = (mip_strip){
+            .width = w,
+            .height = h,
+            .tiles_x = (w + TEXTURE_TILE_SIZE - 1) / TEXTURE_TILE_SIZE,
+            .offset = offset,
+            .rows = malloc((size_t)w * 3 * TEXTURE_TILE_SIZE),
+            .pending = malloc((size_t)w * 3),
+            .next_row = malloc((size_t)max(w / 2, 1) * 3)
+        };
+        if (!strip->rows || !strip->pending || !strip->next_row) exit(1);
+
+        offset += (long long)strip->tiles_x * ((h + TEXTURE_TILE_SIZE - 1) / TEXTURE_TILE_SIZE) * TEXTURE_TILE_BYTES;
+        if ((w == 1 && h == 1) || header.levels == TEXTURE_MAX_LEVELS) break;
+        w = max(w / 2, 1);
+        h = max(h / 2, 1);
+    }
+
+    // stream the source row by row, every level keeps only one row of tiles in memory
+    bool ok = true;
+    unsigned char* row = malloc((size_t)width * 3);
+    if (!row) exit(1);
+    for (int y = 0; y < height && ok; ++y)
+    {
+        for (int x = 0; x < width * 3 && ok; ++x)
+        {
+            int value = 0;
+            if (binary)
+            {
+                value = fgetc(in);
+                ok = value != EOF;
+            }
+            else
+            {
+                ok = fscanf_s(in, "%d", &value) == 1;
+            }
+            row[x] = (unsigned char)(value * 255 / max_value);
+        }
+        if (ok) mip_push_row(strips, header.levels, 0, row, out);
+    }
+    free(row);
+
+    for (int level = 0; level < header.levels; ++level)
+    {
+        free(strips[level].rows);
+        free(strips[level].pending);
+        free(strips[level].next_row);
+    }
+
+    if (ok)
+    {
+        header.magic = TEXTURE_FILE_MAGIC;
+        _fseeki64(out, 0, SEEK_SET);
+        ok = fwrite(&header, sizeof(header), 1, out) == 1;
+    }
+    ok = (fclose(out) == 0) && ok;
+    fclose(in);
+    return ok;
+}
+
+void mip_push_row(mip_strip* strips, int levels, int level, unsigned char* row, FILE* out)
+{
+    mip_strip* strip = &strips[level];
+    memcpy(strip->rows + (size_t)strip->rows_filled * strip->width * 3, row, (size_t)strip->width * 3);
+    ++strip->rows_filled;
+    ++strip->rows_pushed;
+    if (strip->rows_filled == TEXTURE_TILE_SIZE || strip->rows_pushed == strip->height)
+    {
+        mip_flush_tiles(strip, out);
+    }
+
+    if (level + 1 >= levels) return;
+
+    // a single row level is downsampled with itself
+    if (!strip->has_pending && strip->height > 1)
+    {
+        memcpy(strip->pending, row, (size_t)strip->width * 3);
+        strip->has_pending = true;
+        return;
+    }
+
+    unsigned char* above = strip->height > 1 ? strip->pending : row;
+    const int next_width = strips[level + 1].width;
+    for (int x = 0; x < next_width; ++x)
+    {
+        const int x0 = min(2 * x, strip->width - 1);
+        const int x1 = min(2 * x + 1, strip->width - 1);
+        for (int c = 0; c < 3; ++c)
+        {
+            const int sum = above[x0 * 3 + c] + above[x1 * 3 + c] + row[x0 * 3 + c] + row[x1 * 3 + c];
+            strip->next_row[x * 3 + c] = (unsigned char)((sum + 2) / 4);
+        }
+    }
+    strip->has_pending = false;
+    mip_push_row(strips, levels, level + 1, strip->next_row, out);
+}
+
+void mip_flush_tiles(mip_strip* strip, FILE* out)
+{
+    unsigned char tile[TEXTURE_TILE_BYTES];
+    const int tile_row = (strip->rows_pushed - 1) / TEXTURE_TILE_SIZE;
+
+    for (int tx = 0; tx < strip->tiles_x; ++tx)
+    {
+        // edge tiles repeat the last row and column
+        for (int y = 0; y < TEXTURE_TILE_SIZE; ++y)
+        {
+            const unsigned char* src = strip->rows + (size_t)min(y, strip->rows_filled - 1) * strip->width * 3;
+            for (int x = 0; x < TEXTURE_TILE_SIZE; ++x)
+            {
+                const int sx = min(tx * TEXTURE_TILE_SIZE + x, strip->width - 1);
+                memcpy(&tile[(y * TEXTURE_TILE_SIZE + x) * 3], &src[sx * 3], 3);
+            }
+        }
+
+        const long long tile_idx = (long long)tile_row * strip->tiles_x + tx;
+        _fseeki64(out, strip->offset + tile_idx * TEXTURE_TILE_BYTES, SEEK_SET);
+        fwrite(tile, TEXTURE_TILE_BYTES, 1, out);
+    }
+    strip->rows_filled = 0;
+}
+
+void texture_fetch(texture* tex, int level, int x, int y, unsigned char* rgb)
+{
+    const int tx = x / TEXTURE_TILE_SIZE;
+    const int ty = y / TEXTURE_TILE_SIZE;
+    const unsigned long long key = ((unsigned long long)tex->id << 48)
+        | ((unsigned long long)level << 40)
+        | ((unsigned long long)ty << 20)
+        | (unsigned long long)tx;
+    const unsigned long long hash = cache_hash(key);
+    texture_cache_shard* shard = &cache_shards[hash % TEXTURE_CACHE_SHARDS];
+    const int bucket = (int)((hash >> 16) % shard->buckets_count);
+    const int offset = ((y % TEXTURE_TILE_SIZE) * TEXTURE_TILE_SIZE + (x % TEXTURE_TILE_SIZE)) * 3;
+
+    AcquireSRWLockShared(&shard->lock);
+    int slot = cache_find(shard, bucket, key);
+    if (slot >= 0)
+    {
+        shard->slots[slot].referenced = 1;
+        memcpy(rgb, shard->slots[slot].texels + offset, 3);
+        ReleaseSRWLockShared(&shard->lock);
+        return;
+    }
+    ReleaseSRWLockShared(&shard->lock);
+
+    // the disk read runs unlocked, the shard is only held to install the tile
+    unsigned char tile[TEXTURE_TILE_BYTES];
+    texture_read_tile(tex, level, tx, ty, tile);
+
+    AcquireSRWLockExclusive(&shard->lock);
+    slot = cache_find(shard, bucket, key);
+    if (slot < 0)
+    {
+        // not installed by another thread meanwhile
+        slot = cache_evict(shard);
+        memcpy(shard->slots[slot].texels, tile, TEXTURE_TILE_BYTES);
+        shard->slots[slot].key = key;
+        shard->slots[slot].next = shard->buckets[bucket];
+        shard->buckets[bucket] = slot;
+    }
+    shard->slots[slot].referenced = 1;
+    memcpy(rgb, shard->slots[slot].texels + offset, 3);
+    ReleaseSRWLockExclusive(&shard->lock);
+}
+
+void texture_read_tile(texture* tex, int level, int tx, int ty, unsigned char* texels)
+{
+    const long long tile_idx = (long long)ty * tex->tiles_x[level] + tx;
+    const long long offset = tex->level_offset[level] + tile_idx * TEXTURE_TILE_BYTES;
+
+    OVERLAPPED overlapped = { 0 };
+    overlapped.Offset = (DWORD)offset;
+    overlapped.OffsetHigh = (DWORD)(offset >> 32);
+
+    DWORD read = 0;
+    if (!ReadFile(tex->file, texels, TEXTURE_TILE_BYTES, &read, &overlapped) || read != TEXTURE_TILE_BYTES)
+    {
+        for (int i = 0; i < TEXTURE_TILE_BYTES; i += 3)
+        {
+            texels[i + 0] = 255;
+            texels[i + 1] = 0;
+            texels[i + 2] = 255;
+        }
+    }
+}
+
+int cache_find(texture_cache_shard* shard, int bucket, unsigned long long key)
+{
+    for (int slot = shard->buckets[bucket]; slot >= 0; slot = shard->slots[slot].next)
+    {
+        if (shard->slots[slot].key == key) return slot;
+    }
+    return -1;
+}
+
+int cache_evict(texture_cache_shard* shard)
+{
+    // clock sweep, recently used tiles get a second chance
+    while (true)
+    {
+        const int slot = shard->hand;
+        texture_cache_slot* s = &shard->slots[slot];
+        shard->hand = (shard->hand + 1) % shard->slots_count;
+
+        if (s->key == 0) return slot;
+        if (s->referenced)
+        {
+            s->referenced = 0;
+            continue;
+        }
+
+        const int bucket = (int)((cache_hash(s->key) >> 16) % shard->buckets_count);
+        int* link = &shard->buckets[bucket];
+        while (*link != slot) link = &shard->slots[*link].next;
+        *link = s->next;
+
+        s->key = 0;
+        s->next = -1;
+        return slot;
+    }
+}
+
+unsigned long long cache_hash(unsigned long long key)
+{
+    key ^= key >> 33;
+    key *= 0xFF51AFD7ED558CCDull;
+    key ^= key >> 33;
+    key *= 0xC4CEB9FE1A85EC53ull;
+    key ^= key >> 33;
+    return key;
+}
+
+c3f texel_to_linear(unsigned char* rgb)
+{
+    // images are stored with the same gamma 2 the renderer writes
+    const f32 r = rgb[0] / 255.f;
+    const f32 g = rgb[1] / 255.f;
+    const f32 b = rgb[2] / 255.f;
+    return (c3f) { .r = r * r, .g = g * g, .b = b * b };
+}
+
+void file_stamp(const char* path, long long* bytes, long long* time)
+{
+    WIN32_FILE_ATTRIBUTE_DATA data;
+    if (!GetFileAttributesExA(path, GetFileExInfoStandard, &data))
+    {
+        *bytes = 0;
+        *time = 0;
+        return;
+    }
+    *bytes = ((long long)data.nFileSizeHigh << 32) | data.nFileSizeLow;
+    *time = ((long long)data.ftLastWriteTime.dwHighDateTime << 32) | data.ftLastWriteTime.dwLowDateTime;
+}
+
+#undef WIN32_LEAN_AND_MEAN
+#undef TEXTURE_CACHE_SHARDS
+#undef TEXTURE_TILE_BYTES
+#undef TEXTURE_FILE_MAGIC
+#undef CACHE_LINE_SIZE
@@ -0,0 +1,57 @@
+#pragma once
+
+#include "stddef.h"
+#include "defs.h"
+#include "vec3f.h"
+
+#define TEXTURE_TILE_SIZE 32
+#define TEXTURE_MAX_LEVELS 24
+
+typedef struct texture texture;
+typedef struct texture_stamp texture_stamp;
+
+// Image texture backed by a PPM file. On first use the image is converted once into
+// a tiled, mip-mapped sidecar file (<path>.tiles), rebuilt whenever the image size or
+// write time no longer match the ones it was cut from. Afterwards tiles are paged in
+// on demand through the shared, fixed size texture cache.
+struct texture
+{
+    const char* path;
+    int id;
+
+    // internals, valid once prepared
+    volatile long state;
+    void* file;
+    int levels;
+    int width[TEXTURE_MAX_LEVELS];
+    int height[TEXTURE_MAX_LEVELS];
+    int tiles_x[TEXTURE_MAX_LEVELS];
+    long long level_offset[TEXTURE_MAX_LEVELS];
+};
+
+// Size and last write time of the image and of the tile file the texels are read
+// from, zero for a missing file. Content keyed caches use it to notice edited images.
+struct texture_stamp
+{
+    long long image_bytes;
+    long long image_time;
+    long long tiles_bytes;
+    long long tiles_time;
+};
+
+void texture_cache_init(size_t budget_bytes);
+void texture_cache_delete(void);
+
+texture* texture_create(const char* path);
+void     texture_delete(texture* tex);
+
+// Bilinear lookup in linear color, footprint is the size of the ray footprint in uv
+// units and selects the mip level. Missing or broken textures sample as magenta.
+c3f texture_sample(texture* tex, f32 u, f32 v, f32 footprint);
+
+// Loads the mip layout, converting the image on first use. texture_sample does it on
+// demand, false when the texture is missing or broken.
+bool texture_prepare(texture* tex);
+
+// Prepares the texture first, so the tile file is the one the render reads
+bool texture_get_stamp(texture* tex, texture_stamp* stamp);
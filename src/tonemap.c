@@ -0,0 +1,153 @@
+#include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+#include "malloc.h"
+#include "emmintrin.h"
+#include "tonemap.h"
+
+// Utils
+#define QUANTIZE_MAX 0.999f
+#define QUANTIZE_SCALE 255.999f
+
+static f32     tonemap_curve(ETonemapOperator op, f32 v);
+static __m128  tonemap_curve4(ETonemapOperator op, __m128 v);
+static __m128i tonemap_quantize4(ETonemapOperator op, __m128 v, __m128 scale);
+
+static const char* tonemap_operator_names[ETonemapOperator_COUNT] = { "clamp", "reinhard", "aces" };
+
+
+void tonemap_apply(const tonemap_settings* settings, const c3f* hdr, size_t count, unsigned char* rgb8)
+{
+    // every channel goes through the same curve, so the buffer is one flat float array
+    const f32* in = (const f32*)hdr;
+    const size_t n = count * 3;
+    const f32 scale = exp2f(settings->exposure);
+    const __m128 scale4 = _mm_set1_ps(scale);
+
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16)
+    {
+        const __m128i q0 = tonemap_quantize4(settings->op, _mm_loadu_ps(in + i), scale4);
+        const __m128i q1 = tonemap_quantize4(settings->op, _mm_loadu_ps(in + i + 4), scale4);
+        const __m128i q2 = tonemap_quantize4(settings->op, _mm_loadu_ps(in + i + 8), scale4);
+        const __m128i q3 = tonemap_quantize4(settings->op, _mm_loadu_ps(in + i + 12), scale4);
+        _mm_storeu_si128(
+            (__m128i*)(rgb8 + i),
+            _mm_packus_epi16(_mm_packs_epi32(q0, q1), _mm_packs_epi32(q2, q3)));
+    }
+
+    for (; i < n; ++i)
+    {
+        // the curves turn infinite input into NaN, fmaxf maps it to 0 before the cast like _mm_max_ps
+        const f32 v = sqrtf(tonemap_curve(settings->op, fmaxf(in[i] * scale, 0.f)));
+        rgb8[i] = (unsigned char)(fminf(fmaxf(v, 0.f), QUANTIZE_MAX) * QUANTIZE_SCALE);
+    }
+}
+
+bool tonemap_parse_operator(const char* name, ETonemapOperator* op)
+{
+    for (int i = 0; i < ETonemapOperator_COUNT; ++i)
+    {
+        if (strcmp(name, tonemap_operator_names[i]) == 0)
+        {
+            *op = (ETonemapOperator)i;
+            return true;
+        }
+    }
+    return false;
+}
+
+bool hdr_save_pfm(const char* filename, int width, int height, const c3f* hdr)
+{
+    FILE* file = NULL;
+    fopen_s(&file, filename, "wb");
+    if (!file) return false;
+
+    // negative scale marks little endian data
+    fprintf_s(file, "PF\n%d %d\n-1.0\n", width, height);
+    bool ok = true;
+    for (int row = height - 1; row >= 0 && ok; --row)
+    {
+        ok = fwrite(&hdr[row * width], sizeof(c3f), width, file) == (size_t)width;
+    }
+    fclose(file);
+    return ok;
+}
+
+c3f* hdr_load_pfm(const char* filename, int* width, int* height)
+{
+    FILE* file = NULL;
+    fopen_s(&file, filename, "rb");
+    if (!file) return NULL;
+
+    f32 scale = 0.f;
+    if (fscanf_s(file, "PF %d %d %f", width, height, &scale) != 3
+        || *width <= 0
+        || *height <= 0
+        || scale >= 0.f
+        || fgetc(file) == EOF)
+    {
+        fclose(file);
+        return NULL;
+    }
+
+    c3f* hdr = malloc((size_t)*width * *height * sizeof(c3f));
+    if (!hdr) exit(1);
+
+    for (int row = *height - 1; row >= 0; --row)
+    {
+        if (fread(&hdr[row * *width], sizeof(c3f), *width, file) != (size_t)*width)
+        {
+            free(hdr);
+            fclose(file);
+            return NULL;
+        }
+    }
+    fclose(file);
+    return hdr;
+}
+
+f32 tonemap_curve(ETonemapOperator op, f32 v)
+{
+    switch (op)
+    {
+    case ETonemapOperator_REINHARD:
+        return v / (1.f + v);
+    case ETonemapOperator_ACES:
+        // Narkowicz fit of the ACES filmic curve
+        return (v * (2.51f * v + 0.03f)) / (v * (2.43f * v + 0.59f) + 0.14f);
+    default:
+        return v;
+    }
+}
+
+__m128 tonemap_curve4(ETonemapOperator op, __m128 v)
+{
+    switch (op)
+    {
+    case ETonemapOperator_REINHARD:
+        return _mm_div_ps(v, _mm_add_ps(_mm_set1_ps(1.f), v));
+    case ETonemapOperator_ACES:
+    {
+        const __m128 num = _mm_mul_ps(v, _mm_add_ps(_mm_mul_ps(_mm_set1_ps(2.51f), v), _mm_set1_ps(0.03f)));
+        const __m128 den = _mm_add_ps(
+            _mm_mul_ps(v, _mm_add_ps(_mm_mul_ps(_mm_set1_ps(2.43f), v), _mm_set1_ps(0.59f))),
+            _mm_set1_ps(0.14f));
+        return _mm_div_ps(num, den);
+    }
+    default:
+        return v;
+    }
+}
+
+__m128i tonemap_quantize4(ETonemapOperator op, __m128 v, __m128 scale)
+{
+    // same steps as the scalar tail, max returns 0 for NaN inputs like fmaxf
+    v = _mm_max_ps(_mm_mul_ps(v, scale), _mm_setzero_ps());
+    v = _mm_sqrt_ps(tonemap_curve4(op, v));
+    v = _mm_min_ps(_mm_max_ps(v, _mm_setzero_ps()), _mm_set1_ps(QUANTIZE_MAX));
+    return _mm_cvttps_epi32(_mm_mul_ps(v, _mm_set1_ps(QUANTIZE_SCALE)));
+}
+
+#undef QUANTIZE_MAX
+#undef QUANTIZE_SCALE
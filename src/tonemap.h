@@ -0,0 +1,32 @@
+#pragma once
+
+#include "stddef.h"
+#include "defs.h"
+#include "vec3f.h"
+
+typedef enum ETonemapOperator ETonemapOperator;
+typedef struct tonemap_settings tonemap_settings;
+
+enum ETonemapOperator
+{
+    ETonemapOperator_CLAMP,
+    ETonemapOperator_REINHARD,
+    ETonemapOperator_ACES,
+    ETonemapOperator_COUNT
+};
+
+// Display transform applied after rendering, the renderer itself only produces
+// linear radiance so these can be changed without tracing a single ray.
+struct tonemap_settings
+{
+    f32 exposure; // in stops
+    ETonemapOperator op;
+};
+
+// Exposure, tone curve, gamma 2 and 8 bit quantization of count pixels into rgb8
+void tonemap_apply(const tonemap_settings* settings, const c3f* hdr, size_t count, unsigned char* rgb8);
+bool tonemap_parse_operator(const char* name, ETonemapOperator* op);
+
+// Linear radiance as little endian PFM, rows are stored bottom to top
+bool hdr_save_pfm(const char* filename, int width, int height, const c3f* hdr);
+c3f* hdr_load_pfm(const char* filename, int* width, int* height);
@@ -0,0 +1,197 @@
+#include "stdlib.h"
+#include "string.h"
+#include "malloc.h"
+#include "topology.h"
+
+#define WIN32_LEAN_AND_MEAN
+#include "windows.h"
+
+
+// Utils
+#define GROUP_MAX_CPUS 64
+
+static int  affinity_count(KAFFINITY mask);
+static int  affinity_nth(KAFFINITY mask, int n);
+static bool node_nth(const GROUP_AFFINITY* masks, int groups_count, int n, cpu_slot* slot);
+
+
+void topology_query(cpu_topology* topo)
+{
+    memset(topo, 0, sizeof(*topo));
+
+    // one mask per processor group of the node, they point into info
+    const GROUP_AFFINITY* node_masks[TOPOLOGY_MAX_NODES];
+    int node_groups[TOPOLOGY_MAX_NODES];
+    GROUP_AFFINITY fallback_mask;
+
+    DWORD length = 0;
+    GetLogicalProcessorInformationEx(RelationNumaNode, NULL, &length);
+    SYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX* info = length ? malloc(length) : NULL;
+    if (info && GetLogicalProcessorInformationEx(RelationNumaNode, info, &length))
+    {
+        for (char* at = (char*)info; at < (char*)info + length;
+            at += ((SYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX*)at)->Size)
+        {
+            SYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX* record = (SYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX*)at;
+            if (topo->nodes_count == TOPOLOGY_MAX_NODES) break;
+
+            // a node spans several groups on machines with more than 64 cpus, GroupCount
+            // is 0 before Windows 10 and GroupMask then covers the node
+            const int groups_count = max((int)record->NumaNode.GroupCount, 1);
+            int cpus = 0;
+            for (int g = 0; g < groups_count; ++g) cpus += affinity_count(record->NumaNode.GroupMasks[g].Mask);
+
+            // memory only nodes have no processors
+            if (cpus == 0) continue;
+
+            topo->node_numbers[topo->nodes_count] = record->NumaNode.NodeNumber;
+            node_masks[topo->nodes_count] = record->NumaNode.GroupMasks;
+            node_groups[topo->nodes_count] = groups_count;
+            ++topo->nodes_count;
+        }
+    }
+
+    if (topo->nodes_count == 0)
+    {
+        SYSTEM_INFO sys;
+        GetSystemInfo(&sys);
+        const int count = max(min((int)sys.dwNumberOfProcessors, GROUP_MAX_CPUS), 1);
+
+        topo->nodes_count = 1;
+        topo->node_numbers[0] = 0;
+        memset(&fallback_mask, 0, sizeof(fallback_mask));
+        fallback_mask.Mask = count == GROUP_MAX_CPUS ? ~(KAFFINITY)0 : ((KAFFINITY)1 << count) - 1;
+        node_masks[0] = &fallback_mask;
+        node_groups[0] = 1;
+    }
+
+    int total = 0;
+    for (int n = 0; n < topo->nodes_count; ++n)
+    {
+        for (int g = 0; g < node_groups[n]; ++g) total += affinity_count(node_masks[n][g].Mask);
+    }
+
+    topo->cpus = malloc(total * sizeof(cpu_slot));
+    if (!topo->cpus) exit(1);
+
+    // round robin over the nodes, the i-th cpu of every node before the i+1-th one
+    for (int i = 0; topo->cpus_count < total; ++i)
+    {
+        for (int n = 0; n < topo->nodes_count; ++n)
+        {
+            cpu_slot slot = { .node = n };
+            if (node_nth(node_masks[n], node_groups[n], i, &slot)) topo->cpus[topo->cpus_count++] = slot;
+        }
+    }
+    free(info);
+}
+
+void topology_delete(cpu_topology* topo)
+{
+    free(topo->cpus);
+    topo->cpus = NULL;
+    topo->cpus_count = 0;
+    topo->nodes_count = 0;
+}
+
+void topology_pin_thread(cpu_topology* topo, int cpu)
+{
+    const cpu_slot* slot = &topo->cpus[cpu % topo->cpus_count];
+
+    GROUP_AFFINITY affinity;
+    memset(&affinity, 0, sizeof(affinity));
+    affinity.Group = slot->group;
+    affinity.Mask = (KAFFINITY)1 << slot->number;
+
+    // an unpinned worker still renders correctly, only slower
+    SetThreadGroupAffinity(GetCurrentThread(), &affinity, NULL);
+}
+
+void* topology_alloc(cpu_topology* topo, size_t bytes, int node)
+{
+    void* ptr = VirtualAllocExNuma(
+        GetCurrentProcess(),
+        NULL,
+        max(bytes, 1),
+        MEM_RESERVE | MEM_COMMIT,
+        PAGE_READWRITE,
+        topo->node_numbers[node]);
+    if (!ptr) exit(1);
+    return ptr;
+}
+
+void* topology_alloc_rows(cpu_topology* topo, int rows, size_t row_bytes)
+{
+    char* base = VirtualAlloc(NULL, max((size_t)rows * row_bytes, 1), MEM_RESERVE, PAGE_READWRITE);
+    if (!base) exit(1);
+
+    // the page shared by two bands is committed twice, it stays with the first node
+    for (int n = 0; n < topo->nodes_count; ++n)
+    {
+        const size_t first = (size_t)(n * rows / topo->nodes_count) * row_bytes;
+        const size_t end = (size_t)((n + 1) * rows / topo->nodes_count) * row_bytes;
+        if (end <= first) continue;
+
+        if (!VirtualAllocExNuma(
+            GetCurrentProcess(),
+            base + first,
+            end - first,
+            MEM_COMMIT,
+            PAGE_READWRITE,
+            topo->node_numbers[n]))
+        {
+            exit(1);
+        }
+    }
+
+    return base;
+}
+
+void topology_free(void* ptr)
+{
+    if (ptr) VirtualFree(ptr, 0, MEM_RELEASE);
+}
+
+int topology_row_node(cpu_topology* topo, int row, int rows)
+{
+    // inverse of the band split in topology_alloc_rows
+    const int node = ((row + 1) * topo->nodes_count + rows - 1) / rows - 1;
+    return max(min(node, topo->nodes_count - 1), 0);
+}
+
+int affinity_count(KAFFINITY mask)
+{
+    int count = 0;
+    for (; mask; mask &= mask - 1) ++count;
+    return count;
+}
+
+int affinity_nth(KAFFINITY mask, int n)
+{
+    for (int bit = 0; bit < GROUP_MAX_CPUS; ++bit)
+    {
+        if (!(mask & ((KAFFINITY)1 << bit))) continue;
+        if (n-- == 0) return bit;
+    }
+    return -1;
+}
+
+bool node_nth(const GROUP_AFFINITY* masks, int groups_count, int n, cpu_slot* slot)
+{
+    for (int g = 0; g < groups_count; ++g)
+    {
+        const int count = affinity_count(masks[g].Mask);
+        if (n >= count)
+        {
+            n -= count;
+            continue;
+        }
+        slot->group = masks[g].Group;
+        slot->number = (unsigned char)affinity_nth(masks[g].Mask, n);
+        return true;
+    }
+    return false;
+}
+
+#undef WIN32_LEAN_AND_MEAN
+#undef GROUP_MAX_CPUS
@@ -0,0 +1,42 @@
+#pragma once
+
+#include "stddef.h"
+#include "defs.h"
+
+#define TOPOLOGY_MAX_NODES 64
+
+typedef struct cpu_slot cpu_slot;
+typedef struct cpu_topology cpu_topology;
+
+struct cpu_slot
+{
+    unsigned short group; // processor group and number inside it
+    unsigned char number;
+    int node;             // index into cpu_topology node_numbers
+};
+
+// Logical processors of the machine grouped by NUMA node. The cpus are interleaved
+// over the nodes so that any prefix of them spreads evenly over the sockets.
+struct cpu_topology
+{
+    cpu_slot* cpus;
+    int cpus_count;
+    int nodes_count;
+    unsigned long node_numbers[TOPOLOGY_MAX_NODES];
+};
+
+void topology_query(cpu_topology* topo);
+void topology_delete(cpu_topology* topo);
+
+// Restricts the calling thread to the given cpu, best effort
+void topology_pin_thread(cpu_topology* topo, int cpu);
+
+// Zeroed memory with its pages placed on the given node
+void* topology_alloc(cpu_topology* topo, size_t bytes, int node);
+
+// Zeroed memory of rows * row_bytes, the rows are split into one contiguous band
+// per node, see topology_row_node
+void* topology_alloc_rows(cpu_topology* topo, int rows, size_t row_bytes);
+void  topology_free(void* ptr);
+
+int topology_row_node(cpu_topology* topo, int row, int rows);